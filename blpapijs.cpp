@@ -12,16 +12,28 @@
 #include <blpapi_element.h>
 #include <blpapi_name.h>
 #include <blpapi_request.h>
+#include <blpapi_schema.h>
+#include <blpapi_service.h>
 #include <blpapi_subscriptionlist.h>
 #include <blpapi_defs.h>
 
-#include <deque>
+#include "blpapijs_datetime.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
 #include <sstream>
 #include <vector>
 
 #include <cmath>
+#include <cstdio>
 #include <ctime>
 #include <cstdlib>
+#include <cstring>
+
+#include <sched.h>
+#include <sys/time.h>
 
 #define BLPAPI_EXCEPTION_TRY try {
 #define BLPAPI_EXCEPTION_CATCH \
@@ -43,909 +55,6485 @@ using namespace v8;
 namespace BloombergLP {
 namespace blpapijs {
 
-class Session : public ObjectWrap,
-                public blpapi::EventHandler {
-public:
-    Session(const char *host, int port);
-    ~Session();
+struct CStringLess {
+    bool operator()(const char* lhs, const char* rhs) const {
+        return strcmp(lhs, rhs) < 0;
+    }
+};
 
-    static void Initialize(Handle<Object> target);
-    static Handle<Value> New(const Arguments& args);
+// Settings of one subscription which affect how its messages are decoded.
+// 'projection' lists the only fields to decode, in delivery order; when
+// empty every field is decoded.  'conflate' is the minimum number of
+// milliseconds between conflated updates, zero to deliver the latest
+// update each time the queue is drained, or negative to not conflate.
+// 'cache' selects whether numeric fields are kept in the last value cache
+// and whether messages are then still delivered.
+struct Subscription {
+    enum Cache {
+        CACHE_NONE,   // Deliver messages only
+        CACHE,        // Cache fields and deliver messages
+        CACHE_ONLY    // Cache fields without delivering messages
+    };
+
+    // How messages are aggregated into bars instead of being delivered.
+    // A bar closes once 'size' milliseconds, volume or ticks are reached.
+    struct Bars {
+        enum Kind { NONE, TIME, VOLUME, TICKS };
+
+        Kind kind;
+        double size;
+        blpapi::Name price;
+        blpapi::Name volume;
+
+        Bars() : kind(NONE), size(0) {}
+
+        bool operator==(const Bars& rhs) const {
+            return kind == rhs.kind && size == rhs.size &&
+                   (kind == NONE ||
+                    (price == rhs.price && volume == rhs.volume));
+        }
+    };
 
-    static Handle<Value> Start(const Arguments& args);
-    static Handle<Value> Stop(const Arguments& args);
-    static Handle<Value> Destroy(const Arguments& args);
-    static Handle<Value> OpenService(const Arguments& args);
-    static Handle<Value> Subscribe(const Arguments& args);
-    static Handle<Value> Resubscribe(const Arguments& args);
-    static Handle<Value> Request(const Arguments& args);
+    std::vector<blpapi::Name> projection;
+    int conflate;
+    Cache cache;
+    Bars bars;
 
-private:
-    Session();
-    Session(const Session&);
-    Session& operator=(const Session&);
+    explicit Subscription(int c = -1) : conflate(c), cache(CACHE_NONE) {}
 
-    static Handle<Value> subscribe(const Arguments& args, bool resubscribe);
-    static void formFields(std::string* str, Handle<Object> array);
-    static void formOptions(std::string* str, Handle<Value> array);
-    static Handle<Value> elementToValue(const blpapi::Element& e);
-    static Handle<Value> elementValueToValue(const blpapi::Element& e,
-                                             int idx = 0);
+    bool isDefault() const {
+        return projection.empty() && conflate < 0 && cache == CACHE_NONE &&
+               bars.kind == Bars::NONE;
+    }
+};
 
-    bool processEvent(const blpapi::Event& ev, blpapi::Session* session);
-    static void processEvents(uv_async_t *async, int status);
-    void processMessage(blpapi::Event::EventType et,
-                        const blpapi::Message& msg);
+// Settings with which the 'conflate' overflow policy conflates the
+// messages of subscriptions which have none of their own.
+static const Subscription OVERFLOW_CONFLATION(0);
 
-    void emit(int argc, Handle<Value> argv[]);
+typedef std::map<int, Subscription> SubscriptionMap;
 
-    static uv_async_t s_async;
-    static Persistent<String> s_emit;
-    static Persistent<String> s_event_type;
-    static Persistent<String> s_message_type;
-    static Persistent<String> s_topic_name;
-    static Persistent<String> s_correlations;
-    static Persistent<String> s_value;
-    static Persistent<String> s_class_id;
-    static Persistent<String> s_data;
+// Everything a subscription was made with, as recorded in the registry of
+// a session to diff later changes against.
+struct Registration {
+    std::string security;
+    std::string fields;
+    std::string options;
+    Subscription subscription;
 
-    blpapi::SessionOptions d_options;
-    blpapi::Session *d_session;
-    Persistent<Object> d_session_ref;
-    std::deque<blpapi::Event> d_que;
-    pthread_mutex_t d_que_mutex;
-    bool d_started;
-    bool d_stopped;
+    // Class id of the correlation id subscribed with.  A correlation id
+    // whose security changes takes the next one, so that BLPAPI never
+    // sees the same correlation id for two topics.
+    int classId;
+
+    Registration() : classId(0) {}
+
+    bool sameTopic(const Registration& rhs) const {
+        return security == rhs.security;
+    }
+    bool sameRequest(const Registration& rhs) const {
+        return fields == rhs.fields && options == rhs.options;
+    }
+    bool sameSettings(const Registration& rhs) const {
+        return subscription.projection == rhs.subscription.projection &&
+               subscription.conflate == rhs.subscription.conflate &&
+               subscription.cache == rhs.subscription.cache &&
+               subscription.bars == rhs.subscription.bars;
+    }
 };
 
-uv_async_t Session::s_async;
-Persistent<String> Session::s_emit;
-Persistent<String> Session::s_event_type;
-Persistent<String> Session::s_message_type;
-Persistent<String> Session::s_topic_name;
-Persistent<String> Session::s_correlations;
-Persistent<String> Session::s_value;
-Persistent<String> Session::s_class_id;
-Persistent<String> Session::s_data;
+typedef std::vector<std::pair<int, Registration> > RegistrationList;
 
-Session::Session(const char *host, int port)
-    : d_started(false)
-    , d_stopped(false)
+// Return the settings of the subscription which 'msg' belongs to, or null
+// if there are none.
+static inline const Subscription*
+findSubscription(const SubscriptionMap& subscriptions,
+                 const blpapi::Message& msg)
 {
-    d_options.setServerHost(host);
-    d_options.setServerPort(port);
-
-    BLPAPI_EXCEPTION_TRY
-    d_session = new blpapi::Session(d_options, this);
-    BLPAPI_EXCEPTION_CATCH
+    if (subscriptions.empty() || msg.numCorrelationIds() == 0)
+        return 0;
+    blpapi::CorrelationId cid = msg.correlationId(0);
+    if (cid.valueType() != blpapi::CorrelationId::INT_VALUE)
+        return 0;
+    SubscriptionMap::const_iterator it =
+        subscriptions.find(static_cast<int>(cid.asInteger()));
+    return it == subscriptions.end() ? 0 : &it->second;
+}
 
-    pthread_mutex_init(&d_que_mutex, NULL);
+// The merged state of the SUBSCRIPTION_DATA messages of one subscription
+// not yet delivered.  Each field refers to the element of the most recent
+// message carrying it, kept valid by holding that message's event, or for
+// replayed messages holds its value encoded as in 'EventBuffer'.
+// 'position' is the number of events queued before the first message
+// merged since the last delivery.
+struct ConflatedUpdate {
+    struct Field {
+        blpapi_Name_t *name;
+        blpapi::Event event;
+        blpapi::Element element;
+        std::string encoded;
+    };
+
+    blpapi_Name_t *messageType;
+    std::string topic;
+    int correlation;
+    int classId;
+    std::vector<Field> fields;
+    uint64_t position;
+    uint64_t lastDelivery;
+    bool dirty;
+
+    ConflatedUpdate()
+        : messageType(0), correlation(0), classId(0), position(0),
+          lastDelivery(0), dirty(false) {}
+};
 
-    uv_ref(uv_default_loop());
-}
+// Latest numeric value of each field of the cached subscriptions, kept as
+// one column per field indexed by a row per correlation id.  Fields are
+// interned into column ids the first time they are seen.  Written by
+// dispatcher threads and read by the libuv thread.
+class LastValueCache {
+public:
+    LastValueCache() : d_updates(0) { pthread_mutex_init(&d_mutex, NULL); }
+    ~LastValueCache() { pthread_mutex_destroy(&d_mutex); }
+
+    // Store the numeric fields of 'msg', restricted to the projection of
+    // 'subscription' if it has one.
+    void update(const blpapi::Message& msg, const Subscription& subscription);
+
+    // Store the field 'values' of 'correlation', such as those decoded
+    // from a replayed message.
+    void update(int correlation,
+                const std::vector<std::pair<blpapi_Name_t*, double> >& values);
+
+    // Load into 'columns[i]' the value of field 'names[i]' cached for each
+    // of 'correlations', or NaN where none is.
+    void snapshot(const std::vector<int>& correlations,
+                  const std::vector<blpapi_Name_t*>& names,
+                  const std::vector<double*>& columns);
+
+    // Forget the values cached for 'correlation'.
+    void remove(int correlation);
+
+    // Load the number of cached correlation ids and fields.
+    void size(size_t* rows, size_t* fields) const {
+        pthread_mutex_lock(&d_mutex);
+        *rows = d_rows.size();
+        *fields = d_columns.size();
+        pthread_mutex_unlock(&d_mutex);
+    }
 
-Session::~Session()
-{
-    // Ref on the event loop is released in Destroy
+    uint64_t updates() const { return d_updates; }
 
-    pthread_mutex_destroy(&d_que_mutex);
-}
+private:
+    LastValueCache(const LastValueCache&);
+    LastValueCache& operator=(const LastValueCache&);
+
+    mutable pthread_mutex_t d_mutex;
+    std::map<blpapi_Name_t*, uint32_t> d_field_ids;
+    std::map<int, uint32_t> d_rows;
+    std::vector<uint32_t> d_free_rows;
+    std::vector<std::vector<double> > d_columns;
+    uint64_t d_updates;
+};
 
 void
-Session::Initialize(Handle<Object> target)
+LastValueCache::snapshot(const std::vector<int>& correlations,
+                         const std::vector<blpapi_Name_t*>& names,
+                         const std::vector<double*>& columns)
 {
-    HandleScope scope;
-    Local<FunctionTemplate> t = FunctionTemplate::New(Session::New);
-
-    t->InstanceTemplate()->SetInternalFieldCount(1);
+    const double nan = std::numeric_limits<double>::quiet_NaN();
 
-    NODE_SET_PROTOTYPE_METHOD(t, "start", Start);
-    NODE_SET_PROTOTYPE_METHOD(t, "stop", Stop);
-    NODE_SET_PROTOTYPE_METHOD(t, "destroy", Destroy);
-    NODE_SET_PROTOTYPE_METHOD(t, "openService", OpenService);
-    NODE_SET_PROTOTYPE_METHOD(t, "subscribe", Subscribe);
-    NODE_SET_PROTOTYPE_METHOD(t, "resubscribe", Resubscribe);
-    NODE_SET_PROTOTYPE_METHOD(t, "request", Request);
+    pthread_mutex_lock(&d_mutex);
 
-    target->Set(String::NewSymbol("Session"), t->GetFunction());
+    std::vector<const std::vector<double>*> sources(names.size());
+    for (size_t f = 0; f < names.size(); ++f) {
+        std::map<blpapi_Name_t*, uint32_t>::const_iterator it =
+            d_field_ids.find(names[f]);
+        sources[f] = it != d_field_ids.end() ? &d_columns[it->second] : 0;
+    }
 
-    uv_async_init(uv_default_loop(), &s_async, Session::processEvents);
-    uv_unref(uv_default_loop());
+    for (size_t r = 0; r < correlations.size(); ++r) {
+        std::map<int, uint32_t>::const_iterator it =
+            d_rows.find(correlations[r]);
+        for (size_t f = 0; f < names.size(); ++f) {
+            columns[f][r] = it != d_rows.end() && sources[f] &&
+                            it->second < sources[f]->size()
+                          ? (*sources[f])[it->second] : nan;
+        }
+    }
 
-    s_emit = NODE_PSYMBOL("emit");
-    s_event_type = NODE_PSYMBOL("eventType");
-    s_message_type = NODE_PSYMBOL("messageType");
-    s_topic_name = NODE_PSYMBOL("topicName");
-    s_correlations = NODE_PSYMBOL("correlations");
-    s_value = NODE_PSYMBOL("value");
-    s_class_id = NODE_PSYMBOL("classId");
-    s_data = NODE_PSYMBOL("data");
+    pthread_mutex_unlock(&d_mutex);
 }
 
-Handle<Value>
-Session::New(const Arguments& args)
+void
+LastValueCache::remove(int correlation)
 {
-    HandleScope scope;
-
-    char host[128] = "";
-    int port = 0;
+    const double nan = std::numeric_limits<double>::quiet_NaN();
 
-    if (args.Length() > 0 && args[0]->IsObject()) {
-        Local<Object> o = args[0]->ToObject();
+    pthread_mutex_lock(&d_mutex);
 
-        // Capture the host name
-        Local<Value> h = o->Get(String::New("host"));
-        if (h->IsString()) {
-            h->ToString()->WriteAscii(host, 0, sizeof(host));
-            host[sizeof(host)-1] = '\0';
+    std::map<int, uint32_t>::iterator it = d_rows.find(correlation);
+    if (it != d_rows.end()) {
+        for (size_t f = 0; f < d_columns.size(); ++f) {
+            if (it->second < d_columns[f].size())
+                d_columns[f][it->second] = nan;
         }
-        if (0 == host[0])
-            return ThrowException(Exception::Error(String::New(
-                        "Configuration missing 'host'.")));
-
-        // Capture the port number
-        Local<Value> p = o->Get(String::New("port"));
-        if (p->IsInt32())
-            port = p->ToInt32()->Value();
-        if (0 == port)
-            return ThrowException(Exception::Error(String::New(
-                        "Configuration missing non-zero 'port'.")));
-    } else {
-        return ThrowException(Exception::Error(String::New(
-                        "Configuration object must be passed as parameter.")));
+        d_free_rows.push_back(it->second);
+        d_rows.erase(it);
     }
 
-    Session *session = new Session(host, port);
-    session->Wrap(args.This());
-    return scope.Close(args.This());
+    pthread_mutex_unlock(&d_mutex);
 }
 
-Handle<Value>
-Session::Start(const Arguments& args)
-{
-    HandleScope scope;
+// Open, high, low, close, volume and turnover of the ticks of one bar,
+// with its start and end in milliseconds since the epoch.
+struct Bar {
+    double open;
+    double high;
+    double low;
+    double close;
+    double volume;
+    double turnover;
+    uint32_t ticks;
+    double start;
+    double end;
+
+    Bar() : ticks(0) {}
+};
 
-    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+struct CompletedBar {
+    int correlation;
+    int classId;
+    std::string topic;
+    Bar bar;
+};
 
-    if (session->d_started)
-        return ThrowException(Exception::Error(String::New(
-                        "Session has already been started.")));
-    if (session->d_stopped)
-        return ThrowException(Exception::Error(String::New(
-                        "Stopped sessions can not be restarted.")));
+// Aggregates the ticks of bar subscriptions on dispatcher threads, and
+// hands completed bars to the libuv thread.  Time bars are aligned to
+// multiples of their interval since the epoch and are completed by the
+// first tick after their end, or by 'collect'.
+class BarAggregator {
+public:
+    BarAggregator() : d_completed_count(0) {
+        pthread_mutex_init(&d_mutex, NULL);
+    }
+    ~BarAggregator() { pthread_mutex_destroy(&d_mutex); }
 
-    BLPAPI_EXCEPTION_TRY
-    session->d_session->startAsync();
-    BLPAPI_EXCEPTION_CATCH_RETURN
+    // Add the tick at 'price' for 'size' received at 'now' to the bar of
+    // 'correlation'.  Return true if the libuv thread must be woken to
+    // deliver a bar or to time the end of a new one.
+    bool add(int correlation, int classId, const char* topic,
+             const Subscription::Bars& bars, double price, double size,
+             double now);
 
-    session->d_session_ref = Persistent<Object>::New(args.This());
-    session->d_started = true;
+    // Move into 'bars' every completed bar, completing time bars ended by
+    // 'now', and load into 'nextEnd' the end of the earliest open time
+    // bar, or zero if there is none.
+    void collect(std::vector<CompletedBar>* bars, double now,
+                 double* nextEnd);
 
-    return scope.Close(args.This());
+    // Discard the open bar of 'correlation'.
+    void remove(int correlation);
+
+    uint64_t completed() const { return d_completed_count; }
+
+private:
+    BarAggregator(const BarAggregator&);
+    BarAggregator& operator=(const BarAggregator&);
+
+    struct OpenBar {
+        Bar bar;
+        int classId;
+        std::string topic;
+        bool timed;
+    };
+
+    void complete(int correlation, OpenBar* open);
+
+    pthread_mutex_t d_mutex;
+    std::map<int, OpenBar> d_open;
+    std::vector<CompletedBar> d_completed;
+    uint64_t d_completed_count;
+};
+
+void
+BarAggregator::complete(int correlation, OpenBar* open)
+{
+    d_completed.push_back(CompletedBar());
+    CompletedBar& completed = d_completed.back();
+    completed.correlation = correlation;
+    completed.classId = open->classId;
+    completed.topic = open->topic;
+    completed.bar = open->bar;
+    open->bar.ticks = 0;
+    ++d_completed_count;
 }
 
-Handle<Value>
-Session::Stop(const Arguments& args)
+bool
+BarAggregator::add(int correlation, int classId, const char* topic,
+                   const Subscription::Bars& bars, double price, double size,
+                   double now)
 {
-    HandleScope scope;
+    bool wake = false;
 
-    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+    pthread_mutex_lock(&d_mutex);
 
-    if (!session->d_started)
-        return ThrowException(Exception::Error(String::New(
-                        "Session has not been started.")));
-    if (session->d_stopped)
-        return ThrowException(Exception::Error(String::New(
-                        "Session has already been stopped.")));
+    OpenBar& open = d_open[correlation];
+    Bar& bar = open.bar;
+    if (bar.ticks > 0 && open.timed && now >= bar.end) {
+        complete(correlation, &open);
+        wake = true;
+    }
 
-    session->d_stopped = true;
+    if (0 == bar.ticks) {
+        open.classId = classId;
+        open.topic = topic;
+        open.timed = bars.kind == Subscription::Bars::TIME;
+        if (open.timed) {
+            bar.start = floor(now / bars.size) * bars.size;
+            bar.end = bar.start + bars.size;
+            wake = true;
+        } else {
+            bar.start = now;
+        }
+        bar.open = bar.high = bar.low = price;
+        bar.volume = bar.turnover = 0;
+    }
 
-    BLPAPI_EXCEPTION_TRY
-    session->d_session->stopAsync();
-    BLPAPI_EXCEPTION_CATCH_RETURN
+    if (price > bar.high)
+        bar.high = price;
+    if (price < bar.low)
+        bar.low = price;
+    bar.close = price;
+    bar.volume += size;
+    bar.turnover += price * size;
+    ++bar.ticks;
+    if (!open.timed)
+        bar.end = now;
+
+    if ((bars.kind == Subscription::Bars::VOLUME && bar.volume >= bars.size) ||
+        (bars.kind == Subscription::Bars::TICKS && bar.ticks >= bars.size)) {
+        complete(correlation, &open);
+        wake = true;
+    }
 
-    return scope.Close(args.This());
+    pthread_mutex_unlock(&d_mutex);
+
+    return wake;
 }
 
-Handle<Value>
-Session::Destroy(const Arguments& args)
+void
+BarAggregator::collect(std::vector<CompletedBar>* bars, double now,
+                       double* nextEnd)
 {
-    HandleScope scope;
+    *nextEnd = 0;
+
+    pthread_mutex_lock(&d_mutex);
+
+    for (std::map<int, OpenBar>::iterator it = d_open.begin();
+         it != d_open.end(); ++it) {
+        OpenBar& open = it->second;
+        if (!open.timed || 0 == open.bar.ticks)
+            continue;
+        if (open.bar.end <= now)
+            complete(it->first, &open);
+        else if (0 == *nextEnd || open.bar.end < *nextEnd)
+            *nextEnd = open.bar.end;
+    }
+    bars->swap(d_completed);
 
-    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+    pthread_mutex_unlock(&d_mutex);
+}
 
-    if (!session->d_started)
-        return ThrowException(Exception::Error(String::New(
-                        "Session has not been started.")));
-    if (!session->d_stopped)
-        return ThrowException(Exception::Error(String::New(
-                        "Session has not been stopped.")));
+void
+BarAggregator::remove(int correlation)
+{
+    pthread_mutex_lock(&d_mutex);
+    d_open.erase(correlation);
+    pthread_mutex_unlock(&d_mutex);
+}
 
-    session->d_session_ref.Dispose();
+// Merges SUBSCRIPTION_DATA messages of conflated subscriptions field by
+// field on dispatcher threads, and hands the merged updates to the libuv
+// thread once they are due.
+class Conflator {
+public:
+    Conflator() : d_pending(0), d_merged(0), d_delivered(0) {
+        pthread_mutex_init(&d_mutex, NULL);
+    }
+    ~Conflator() { pthread_mutex_destroy(&d_mutex); }
+
+    // Merge the fields of 'msg', from 'ev', into the pending update of
+    // its subscription, with 'position' events queued before it.
+    void merge(const blpapi::Event& ev, const blpapi::Message& msg,
+               const Subscription& subscription, uint64_t position);
+
+    // Merge the encoded 'fields' of a replayed message into the pending
+    // update of 'correlation', with 'position' events queued before it.
+    void merge(int correlation, int classId, blpapi_Name_t* messageType,
+               const char* topic,
+               const std::vector<ConflatedUpdate::Field>& fields,
+               uint64_t position);
+
+    // Move into 'updates' the pending update of 'correlation', if any,
+    // whatever its interval, so that it is delivered ahead of another
+    // message of the same subscription.  Return true if there was one.
+    bool take(int correlation, std::vector<ConflatedUpdate>* updates);
+
+    // Move into 'updates' every pending update due at 'now', in
+    // milliseconds, of which all the events queued before it are among
+    // the 'dequeued' first.  Load into 'nextDue' the time the earliest
+    // update held back by its interval falls due, or zero if there is
+    // none.  Forget the subscriptions idle for their whole interval.
+    void collect(std::vector<ConflatedUpdate>* updates, uint64_t now,
+                 uint64_t dequeued, const SubscriptionMap& subscriptions,
+                 uint64_t* nextDue);
+
+    // Forget the state of 'correlation', once unsubscribed.
+    void remove(int correlation);
+
+    // Number of subscriptions with a pending update.  May be read
+    // without locking as a hint.
+    uint32_t pending() const { return d_pending; }
+    uint64_t merged() const { return d_merged; }
+    uint64_t delivered() const { return d_delivered; }
 
-    uv_unref(uv_default_loop());
+private:
+    Conflator(const Conflator&);
+    Conflator& operator=(const Conflator&);
+
+    typedef std::map<int, ConflatedUpdate> UpdateMap;
+
+    ConflatedUpdate* mark(int correlation, int classId, const char* topic,
+                          uint64_t position);
+    ConflatedUpdate::Field* findField(ConflatedUpdate* update,
+                                      blpapi_Name_t* name, size_t hint);
+    void mergeField(ConflatedUpdate* update, const blpapi::Event& ev,
+                    const blpapi::Element& element, size_t hint);
+    void deliver(ConflatedUpdate* update,
+                 std::vector<ConflatedUpdate>* updates);
+
+    pthread_mutex_t d_mutex;
+
+    // Updates of the subscriptions with a pending update, and of those
+    // delivered within their interval, whose time of delivery paces the
+    // next one.  Entries are erased once idle for a whole interval.
+    UpdateMap d_updates;
+    std::set<int> d_dirty;
+    std::set<int> d_cooling;
+    volatile uint32_t d_pending;
+    volatile uint64_t d_merged;
+    uint64_t d_delivered;
+};
 
-    return scope.Close(args.This());
+ConflatedUpdate*
+Conflator::mark(int correlation, int classId, const char* topic,
+                uint64_t position)
+{
+    ConflatedUpdate& update = d_updates[correlation];
+    if (!update.dirty) {
+        update.dirty = true;
+        update.correlation = correlation;
+        update.classId = classId;
+        update.topic = topic;
+        update.position = position;
+        d_dirty.insert(correlation);
+        ++d_pending;
+    }
+    return &update;
 }
 
-Handle<Value>
-Session::OpenService(const Arguments& args)
+ConflatedUpdate::Field*
+Conflator::findField(ConflatedUpdate* update, blpapi_Name_t* name,
+                     size_t hint)
 {
-    HandleScope scope;
-
-    if (args.Length() < 1 || !args[0]->IsString()) {
-        return ThrowException(Exception::Error(String::New(
-                "Service URI string must be provided as first parameter.")));
-    }
-    if (args.Length() < 2 || !args[1]->IsInt32()) {
-        return ThrowException(Exception::Error(String::New(
-                "Integer correlation identifier must be provided "
-                "as second parameter.")));
+    // Messages usually repeat the same field order, so try the field at
+    // the same position before searching.
+    std::vector<ConflatedUpdate::Field>& fields = update->fields;
+    size_t i = hint;
+    if (i >= fields.size() || fields[i].name != name) {
+        for (i = 0; i < fields.size(); ++i) {
+            if (fields[i].name == name)
+                break;
+        }
     }
-    if (args.Length() > 2) {
-        return ThrowException(Exception::Error(String::New(
-                "Function expects at most two arguments.")));
+    if (i == fields.size()) {
+        fields.push_back(ConflatedUpdate::Field());
+        fields[i].name = name;
     }
+    return &fields[i];
+}
 
-    Local<String> s = args[0]->ToString();
-    std::vector<char> uriv;
-    uriv.reserve(s->Utf8Length() + 1);
-    s->WriteUtf8(&uriv[0]);
+void
+Conflator::mergeField(ConflatedUpdate* update, const blpapi::Event& ev,
+                      const blpapi::Element& element, size_t hint)
+{
+    ConflatedUpdate::Field *field =
+        findField(update, element.name().impl(), hint);
+    field->event = ev;
+    field->element = element;
+    field->encoded.clear();
+}
 
-    int cidi = args[1]->Int32Value();
-    blpapi::CorrelationId cid(cidi);
+void
+Conflator::merge(const blpapi::Event& ev, const blpapi::Message& msg,
+                 const Subscription& subscription, uint64_t position)
+{
+    blpapi::CorrelationId cid = msg.correlationId(0);
+    blpapi::Element e = msg.asElement();
 
-    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+    pthread_mutex_lock(&d_mutex);
 
-    BLPAPI_EXCEPTION_TRY
-    session->d_session->openServiceAsync(&uriv[0], cid);
-    BLPAPI_EXCEPTION_CATCH_RETURN
+    ConflatedUpdate *update = mark(static_cast<int>(cid.asInteger()),
+                                   cid.classId(), msg.topicName(), position);
+    update->messageType = msg.messageType().impl();
 
-    return scope.Close(Integer::New(cidi));
+    if (subscription.projection.empty()) {
+        const size_t numElements = e.numElements();
+        for (size_t i = 0; i < numElements; ++i)
+            mergeField(update, ev, e.getElement(i), i);
+    } else {
+        for (size_t i = 0; i < subscription.projection.size(); ++i) {
+            blpapi::Element se;
+            if (0 == e.getElement(&se, subscription.projection[i]))
+                mergeField(update, ev, se, i);
+        }
+    }
+    ++d_merged;
+
+    pthread_mutex_unlock(&d_mutex);
 }
 
 void
-Session::formFields(std::string* str, Handle<Object> object)
+Conflator::merge(int correlation, int classId, blpapi_Name_t* messageType,
+                 const char* topic,
+                 const std::vector<ConflatedUpdate::Field>& fields,
+                 uint64_t position)
 {
-    // Use the HandleScope of the calling function for speed.
-
-    assert(object->IsArray());
+    pthread_mutex_lock(&d_mutex);
 
-    std::stringstream ss;
+    ConflatedUpdate *update = mark(correlation, classId, topic, position);
+    update->messageType = messageType;
 
-    // Format each array value into the options string "V[&V]"
-    for (int i = 0; i < Array::Cast(*object)->Length(); ++i) {
-        Local<String> s = object->Get(i)->ToString();
-        std::vector<char> v;
-        v.reserve(s->Utf8Length() + 1);
-        s->WriteUtf8(&v[0]);
-        if (i > 0)
-            ss << ",";
-        ss << &v[0];
+    for (size_t i = 0; i < fields.size(); ++i) {
+        ConflatedUpdate::Field *field =
+            findField(update, fields[i].name, i);
+        field->event = blpapi::Event();
+        field->element = blpapi::Element();
+        field->encoded = fields[i].encoded;
     }
+    ++d_merged;
 
-    *str = ss.str();
+    pthread_mutex_unlock(&d_mutex);
 }
 
 void
-Session::formOptions(std::string* str, Handle<Value> value)
+Conflator::deliver(ConflatedUpdate* update,
+                   std::vector<ConflatedUpdate>* updates)
 {
-    // Use the HandleScope of the calling function for speed.
+    updates->push_back(ConflatedUpdate());
+    ConflatedUpdate& ready = updates->back();
+    ready.messageType = update->messageType;
+    ready.topic.swap(update->topic);
+    ready.correlation = update->correlation;
+    ready.classId = update->classId;
+    ready.fields.swap(update->fields);
+    update->dirty = false;
+    --d_pending;
+    ++d_delivered;
+}
 
-    if (value->IsUndefined() || value->IsNull())
-        return;
-
-    assert(value->IsObject());
+bool
+Conflator::take(int correlation, std::vector<ConflatedUpdate>* updates)
+{
+    pthread_mutex_lock(&d_mutex);
+
+    UpdateMap::iterator it = d_updates.find(correlation);
+    bool taken = it != d_updates.end() && it->second.dirty;
+    if (taken) {
+        // The time of the last delivery is kept, so the interval still
+        // runs from it.
+        deliver(&it->second, updates);
+        d_dirty.erase(correlation);
+        d_cooling.insert(correlation);
+    }
 
-    std::stringstream ss;
+    pthread_mutex_unlock(&d_mutex);
+    return taken;
+}
 
-    if (value->IsArray()) {
-        // Format each array value into the options string "V[&V]"
-        Local<Object> object = value->ToObject();
-        for (int i = 0; i < Array::Cast(*object)->Length(); ++i) {
-            Local<String> key = object->Get(i)->ToString();
-            std::vector<char> valv;
-            valv.reserve(key->Utf8Length() + 1);
-            key->WriteUtf8(&valv[0]);
-            if (i > 0)
-                ss << "&";
-            ss << &valv[0];
+void
+Conflator::collect(std::vector<ConflatedUpdate>* updates, uint64_t now,
+                   uint64_t dequeued, const SubscriptionMap& subscriptions,
+                   uint64_t* nextDue)
+{
+    *nextDue = 0;
+
+    pthread_mutex_lock(&d_mutex);
+
+    // Updates of subscriptions no longer conflated are due at once.
+    std::set<int>::iterator it = d_cooling.begin();
+    while (it != d_cooling.end()) {
+        UpdateMap::iterator uit = d_updates.find(*it);
+        SubscriptionMap::const_iterator sit = subscriptions.find(*it);
+        uint64_t interval = sit != subscriptions.end() &&
+                            sit->second.conflate > 0 ? sit->second.conflate
+                                                     : 0;
+        if (uit == d_updates.end() || uit->second.dirty) {
+            d_cooling.erase(it++);
+        } else if (uit->second.lastDelivery + interval <= now) {
+            d_updates.erase(uit);
+            d_cooling.erase(it++);
+        } else {
+            ++it;
         }
-    } else {
-        // Format each KV pair into the options string "K=V[&K=V]"
-        Local<Object> object = value->ToObject();
-        Local<Array> keys = object->GetPropertyNames();
-        for (int i = 0; i < keys->Length(); ++i) {
-            Local<String> key = keys->Get(i)->ToString();
-            std::vector<char> keyv;
-            keyv.reserve(key->Utf8Length() + 1);
-            key->WriteUtf8(&keyv[0]);
-            if (i > 0)
-                ss << "&";
-            ss << &keyv[0] << "=";
+    }
 
-            Local<String> val = object->Get(key)->ToString();
-            std::vector<char> valv;
-            valv.reserve(val->Utf8Length() + 1);
-            val->WriteUtf8(&valv[0]);
-            ss << &valv[0];
+    it = d_dirty.begin();
+    while (it != d_dirty.end()) {
+        UpdateMap::iterator uit = d_updates.find(*it);
+        ConflatedUpdate& update = uit->second;
+        SubscriptionMap::const_iterator sit = subscriptions.find(*it);
+        uint64_t interval = sit != subscriptions.end() &&
+                            sit->second.conflate > 0 ? sit->second.conflate
+                                                     : 0;
+
+        // Events queued before the update are delivered first; the drain
+        // which dequeues them collects it.
+        if (update.position > dequeued) {
+            ++it;
+            continue;
+        }
+        uint64_t due = update.lastDelivery + interval;
+        if (due > now) {
+            if (0 == *nextDue || due < *nextDue)
+                *nextDue = due;
+            ++it;
+            continue;
         }
+
+        deliver(&update, updates);
+        update.lastDelivery = now;
+        if (interval > 0)
+            d_cooling.insert(*it);
+        else
+            d_updates.erase(uit);
+        d_dirty.erase(it++);
     }
 
-    *str = ss.str();
+    pthread_mutex_unlock(&d_mutex);
 }
 
-Handle<Value>
-Session::subscribe(const Arguments& args, bool resubscribe)
+void
+Conflator::remove(int correlation)
 {
-    HandleScope scope;
-
-    if (args.Length() < 1 || !args[0]->IsArray()) {
-        return ThrowException(Exception::Error(String::New(
-                "Array of subscription information must be provided.")));
+    pthread_mutex_lock(&d_mutex);
+
+    UpdateMap::iterator it = d_updates.find(correlation);
+    if (it != d_updates.end()) {
+        if (it->second.dirty)
+            --d_pending;
+        d_updates.erase(it);
+        d_dirty.erase(correlation);
+        d_cooling.erase(correlation);
     }
-    if (args.Length() >= 2 && !args[1]->IsUndefined() && !args[1]->IsString()) {
-        return ThrowException(Exception::Error(String::New(
-                "Optional subscription label must be a string.")));
+
+    pthread_mutex_unlock(&d_mutex);
+}
+
+// Set of the indices of messages within an event, such as those not to
+// be delivered with it.  The first 64 are kept inline, as events seldom
+// carry more messages.
+class MessageSet {
+public:
+    MessageSet() : d_first(0) {}
+
+    void insert(uint32_t i) {
+        if (i < 64) {
+            d_first |= 1ULL << i;
+            return;
+        }
+        size_t word = i / 64 - 1;
+        if (word >= d_rest.size())
+            d_rest.resize(word + 1);
+        d_rest[word] |= 1ULL << (i % 64);
     }
-    if (args.Length() > 2) {
-        return ThrowException(Exception::Error(String::New(
-                "Function expects at most two arguments.")));
+
+    bool contains(uint32_t i) const {
+        if (i < 64)
+            return 0 != (d_first & (1ULL << i));
+        size_t word = i / 64 - 1;
+        return word < d_rest.size() && 0 != (d_rest[word] & (1ULL << (i % 64)));
     }
 
-    blpapi::SubscriptionList sl;
+    bool empty() const { return 0 == d_first && d_rest.empty(); }
 
-    Local<Object> o = args[0]->ToObject();
-    for (int i = 0; i < Array::Cast(*(args[0]))->Length(); ++i) {
-        Local<Value> v = o->Get(i);
-        if (!v->IsObject()) {
-            return ThrowException(Exception::Error(String::New(
-                        "Array elements must be objects "
-                        "containing subscription information.")));
-        }
-        Local<Object> io = v->ToObject();
+private:
+    uint64_t d_first;
+    std::vector<uint64_t> d_rest;
+};
 
-        // Process 'security' string
-        Local<Value> iv = io->Get(String::New("security"));
-        if (!iv->IsString()) {
-            return ThrowException(Exception::Error(String::New(
-                        "Property 'security' must be a string.")));
+// Flat encoding of the messages of one SUBSCRIPTION_DATA event, written
+// on a BLPAPI dispatcher thread so that the libuv thread only has to
+// materialize Javascript values.  Values are laid out in native byte
+// order in a single growable arena:
+//
+//   event   := numMessages:uint32 message*
+//   message := messageType:name topic:string numCids:uint32 cid* value
+//   cid     := valueType:uint8 value:int64 classId:int32
+//   name    := blpapi_Name_t* (valid while the event is referenced), or
+//              string in the portable encoding used by recordings
+//   string  := length:uint32 bytes '\0'
+//   value   := tag:uint8, followed by
+//              TAG_CHAR:char | TAG_INT32:int32 | TAG_NUMBER:double |
+//              TAG_STRING:string | TAG_NAME:name | TAG_DATE:double |
+//              TAG_OBJECT:count:uint32 (name value)* |
+//              TAG_ARRAY:count:uint32 value*
+class EventBuffer {
+public:
+    enum Tag {
+        TAG_NULL,
+        TAG_TRUE,
+        TAG_FALSE,
+        TAG_CHAR,
+        TAG_INT32,
+        TAG_NUMBER,
+        TAG_STRING,
+        TAG_NAME,
+        TAG_DATE,
+        TAG_OBJECT,
+        TAG_ARRAY
+    };
+
+    // Sequential reader over the contents of an 'EventBuffer'.
+    class Reader {
+    public:
+        explicit Reader(const EventBuffer& buffer)
+            : d_pos(&buffer.d_data[0]) {}
+        explicit Reader(const char* data) : d_pos(data) {}
+
+        template <class T> T read() {
+            T value;
+            memcpy(&value, d_pos, sizeof(T));
+            d_pos += sizeof(T);
+            return value;
         }
-        std::vector<char> secv;
-        secv.reserve(iv->ToString()->Length() + 1);
-        iv->ToString()->WriteUtf8(&secv[0]);
-
-        // Process 'fields' array
-        iv = io->Get(String::New("fields"));
-        if (!iv->IsArray()) {
-            return ThrowException(Exception::Error(String::New(
-                        "Property 'fields' must be an array of strings.")));
+        const char* readString(uint32_t* length) {
+            *length = read<uint32_t>();
+            const char *str = d_pos;
+            d_pos += *length + 1;
+            return str;
         }
-        std::string fields;
-        formFields(&fields, iv->ToObject());
+        const char* position() const { return d_pos; }
+
+        // Advance past the next value, whatever its type.
+        void skipValue();
+
+    private:
+        const char *d_pos;
+    };
+
+    // Encode the messages of 'ev' not flagged in 'skip', applying the
+    // field projections in 'subscriptions'.  A 'portable' encoding
+    // spells out names so that it may outlive the process.  May throw
+    // 'blpapi::Exception'.
+    EventBuffer(const blpapi::Event& ev, const SubscriptionMap& subscriptions,
+                const MessageSet& skip, bool portable = false);
+
+    // Encode a single message of the specified 'messageType', with no
+    // topic, correlation ids or fields.
+    explicit EventBuffer(const blpapi::Name& messageType);
+
+    // Begin an empty buffer, to which synthesized messages are added by
+    // 'addMessage', each followed by exactly 'numFields' calls to
+    // 'addNumber'.
+    EventBuffer() : d_portable(false) { write<uint32_t>(0); }
+
+    void addMessage(const blpapi::Name& messageType, const char* topic,
+                    int correlation, uint32_t numFields);
+    void addNumber(const blpapi::Name& name, double value) {
+        writeName(name);
+        write<uint8_t>(TAG_NUMBER);
+        write<double>(value);
+    }
 
-        // Process 'options' array
-        iv = io->Get(String::New("options"));
-        if (!iv->IsUndefined() && !iv->IsNull() && !iv->IsObject()) {
-            return ThrowException(Exception::Error(String::New(
-                        "Property 'options' must be an object containing "
-                        "whose keys and key values will be configured as "
-                        "options.")));
-        }
-        std::string options;
-        formOptions(&options, iv);
+    // Append a message copied from another buffer: either the whole of
+    // its encoding, or its type, topic and correlation ids, followed by
+    // exactly 'numFields' calls to 'copyField' with encoded values.
+    void copyMessage(const char* data, size_t length);
+    void copyMessageHeader(const char* data, size_t length,
+                           uint32_t numFields);
+    void copyField(blpapi_Name_t* name, const char* value, size_t length) {
+        write<blpapi_Name_t*>(name);
+        writeBytes(value, length);
+    }
 
-        // Process 'correlation' int or string
-        iv = io->Get(String::New("correlation"));
-        if (!iv->IsInt32()) {
-            return ThrowException(Exception::Error(String::New(
-                        "Property 'correlation' must be an integer.")));
+    // Return a new buffer decoding the portable encoding of 'length'
+    // bytes at 'data', and load the type of its first message into
+    // 'messageType', or return 0 if the data is malformed.
+    static EventBuffer* fromPortable(const char* data, size_t length,
+                                     blpapi_Name_t** messageType);
+
+    const char* data() const { return &d_data[0]; }
+    size_t size() const { return d_data.size(); }
+
+    // Bounds checked reader over an encoding from outside the process.
+    class Cursor {
+    public:
+        Cursor(const char* data, size_t length)
+            : d_pos(data), d_end(data + length) {}
+
+        template <class T> bool read(T* value) {
+            if (static_cast<size_t>(d_end - d_pos) < sizeof(T))
+                return false;
+            memcpy(value, d_pos, sizeof(T));
+            d_pos += sizeof(T);
+            return true;
+        }
+        bool readString(const char** str, uint32_t* length) {
+            if (!read(length) ||
+                static_cast<size_t>(d_end - d_pos) <= *length ||
+                '\0' != d_pos[*length])
+                return false;
+            *str = d_pos;
+            d_pos += *length + 1;
+            return true;
         }
-        int correlation = iv->Int32Value();
+        bool atEnd() const { return d_pos == d_end; }
+
+    private:
+        const char *d_pos;
+        const char *d_end;
+    };
+
+private:
+    EventBuffer(const EventBuffer&);
+    EventBuffer& operator=(const EventBuffer&);
 
-        sl.add(&secv[0], fields.c_str(), options.c_str(),
-               blpapi::CorrelationId(correlation));
+    template <class T> void write(T value) {
+        size_t n = d_data.size();
+        d_data.resize(n + sizeof(T));
+        memcpy(&d_data[n], &value, sizeof(T));
+    }
+    void writeBytes(const char* data, size_t length) {
+        size_t n = d_data.size();
+        d_data.resize(n + length);
+        memcpy(&d_data[n], data, length);
     }
+    void writeString(const char* str, size_t length);
+    void writeName(const blpapi::Name& name);
+    void countMessage();
+    void writeMessage(const blpapi::Message& msg,
+                      const Subscription* subscription);
+    void writeElement(const blpapi::Element& e);
+    void writeProjection(const blpapi::Element& e,
+                         const std::vector<blpapi::Name>& projection);
+    void writeValue(const blpapi::Element& e, int idx);
+
+    // Append the contents at 'cursor', in the portable encoding, with
+    // names resolved to their handles.  Return false if malformed.
+    bool copyPortableMessages(Cursor* cursor, blpapi_Name_t** messageType);
+    bool copyName(Cursor* cursor, blpapi_Name_t** name = 0);
+    bool copyPortableString(Cursor* cursor);
+    bool copyPortableValue(Cursor* cursor, int depth);
+
+    std::vector<char> d_data;
+    bool d_portable;
+};
 
-    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+// Ids of the names used by the wire encoding of a session.  Ids are only
+// ever appended, in order of first use, so a fragment needs only the
+// count of names once it was encoded, and a chunk the largest count of
+// its fragments.  'id' may briefly release the read lock to assign one,
+// letting other threads assign theirs in between.
+class WireDictionary {
+public:
+    WireDictionary() {
+        pthread_rwlock_init(&d_lock, NULL);
+        d_offsets.push_back(0);
+    }
+    ~WireDictionary() { pthread_rwlock_destroy(&d_lock); }
 
-    BLPAPI_EXCEPTION_TRY
-    if (args.Length() == 2) {
-        Local<String> s = args[1]->ToString();
-        std::vector<char> labelv;
-        labelv.reserve(s->Length() + 1);
-        s->WriteUtf8(&labelv[0]);
-        if (resubscribe)
-            session->d_session->resubscribe(sl, &labelv[0], labelv.size());
-        else
-            session->d_session->subscribe(sl, &labelv[0], labelv.size());
-    } else {
-        if (resubscribe)
-            session->d_session->resubscribe(sl);
-        else
-            session->d_session->subscribe(sl);
+    void lock() const { pthread_rwlock_rdlock(&d_lock); }
+    void unlock() const { pthread_rwlock_unlock(&d_lock); }
+
+    // Return the id of 'name', assigning the next one if it has none.
+    // Must be called with the read lock held.
+    uint32_t id(blpapi_Name_t* name);
+
+    // Return the number of names with an id.  Must be called with the
+    // read lock held.
+    uint32_t size() const { return d_names.size(); }
+
+    // Return the size of the strings of the first 'count' names, and copy
+    // them to 'out'.
+    size_t stringsSize(uint32_t count) const;
+    void copyStrings(uint32_t count, char* out) const;
+
+private:
+    WireDictionary(const WireDictionary&);
+    WireDictionary& operator=(const WireDictionary&);
+
+    mutable pthread_rwlock_t d_lock;
+    std::map<blpapi_Name_t*, uint32_t> d_ids;
+    std::vector<blpapi_Name_t*> d_names;
+    std::vector<size_t> d_offsets;
+};
+
+// The messages of one event in the wire encoding, encoded on the producer
+// thread which received it so that the libuv thread only has to copy them
+// into a chunk.  'numNames' is the size of the dictionary once encoded,
+// above the ids of all the names used.
+class WireFragment {
+public:
+    // Encode the messages of 'buffer', of the specified 'eventType', with
+    // their names replaced by ids in 'dictionary'.
+    WireFragment(int eventType, const EventBuffer& buffer,
+                 WireDictionary* dictionary);
+
+    uint32_t numMessages() const { return d_messages; }
+    uint32_t numNames() const { return d_names; }
+    const char* data() const { return d_body.empty() ? 0 : &d_body[0]; }
+    size_t size() const { return d_body.size(); }
+
+private:
+    WireFragment(const WireFragment&);
+    WireFragment& operator=(const WireFragment&);
+
+    template <class T> void write(T value) {
+        size_t n = d_body.size();
+        d_body.resize(n + sizeof(T));
+        memcpy(&d_body[n], &value, sizeof(T));
     }
-    BLPAPI_EXCEPTION_CATCH_RETURN
+    void writeName(blpapi_Name_t* name) {
+        write<uint32_t>(d_dictionary->id(name));
+    }
+    void copyString(EventBuffer::Reader* reader);
+    void copyValue(EventBuffer::Reader* reader);
 
-    return scope.Close(args.This());
-}
+    WireDictionary *d_dictionary;
+    std::vector<char> d_body;
+    uint32_t d_messages;
+    uint32_t d_names;
+};
 
-Handle<Value>
-Session::Subscribe(const Arguments& args)
-{
-    return Session::subscribe(args, false);
-}
+// An event handed from a dispatcher thread to the libuv thread.  'buffer'
+// holds the pre-decoded messages when the session decodes on dispatcher
+// threads, and 'wire' the encoded ones when it delivers subscription data
+// in the wire encoding.  'skip' holds the messages already conflated,
+// cached or aggregated, which must not be delivered.  'conflated' holds
+// the pending conflated updates of the subscriptions of its other
+// messages, which must be delivered first.  The pointers are owned by
+// whoever holds the 'QueuedEvent' and freed by 'release'.  'received' is
+// the 'uv_hrtime' at which the dispatcher thread received the event, when
+// latency is being measured.  Replayed events have no 'event' and are
+// always pre-decoded.
+struct QueuedEvent {
+    blpapi::Event event;
+    int eventType;
+    EventBuffer *buffer;
+    WireFragment *wire;
+    std::vector<ConflatedUpdate> *conflated;
+    MessageSet skip;
+    uint64_t received;
+
+    QueuedEvent()
+        : eventType(0), buffer(0), wire(0), conflated(0), received(0) {}
+
+    void release() {
+        delete buffer;
+        buffer = 0;
+        delete wire;
+        wire = 0;
+        delete conflated;
+        conflated = 0;
+    }
+};
 
-Handle<Value>
-Session::Resubscribe(const Arguments& args)
-{
-    return Session::subscribe(args, true);
-}
+// Appends every event of a session to a file for later replay.  Events
+// are recorded in full, before any conflation or projection, in the
+// portable encoding of 'EventBuffer':
+//
+//   file   := magic:char[8] version:uint32 record*
+//   record := length:uint32 time:double eventType:int32 event
+//
+// where 'length' counts the bytes following it and 'time' is in
+// milliseconds since the epoch.
+class EventRecorder {
+public:
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 1;
 
-static inline void
-mkdatetime(blpapi::Datetime* dt, Local<Value> val)
-{
-    double ms = Date::Cast(*val)->NumberValue();
-    time_t sec = static_cast<time_t>(ms / 1000.0);
-    int remainder = static_cast<int>(fmod(ms, 1000.0));
+    EventRecorder() : d_file(0) { pthread_mutex_init(&d_mutex, NULL); }
+    ~EventRecorder() {
+        close();
+        pthread_mutex_destroy(&d_mutex);
+    }
 
-    struct tm tm;
-    gmtime_r(&sec, &tm);
+    // Create the file at 'path' and write its header.  Return false on
+    // failure.
+    bool open(const char* path);
 
-    dt->setDate(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
-    dt->setTime(tm.tm_hour, tm.tm_min, tm.tm_sec, remainder);
-}
+    // Flush and close the file; later events are not recorded.
+    void close();
 
-Handle<Value>
-Session::Request(const Arguments& args)
-{
-    HandleScope scope;
+    bool isOpen() const { return 0 != d_file; }
 
-    if (args.Length() < 1 || !args[0]->IsString()) {
-        return ThrowException(Exception::Error(String::New(
-                "Service URI string must be provided as first parameter.")));
+    void record(const blpapi::Event& ev);
+
+private:
+    EventRecorder(const EventRecorder&);
+    EventRecorder& operator=(const EventRecorder&);
+
+    FILE *d_file;
+    pthread_mutex_t d_mutex;
+};
+
+const char EventRecorder::MAGIC[8] = { 'B', 'L', 'P', 'J', 'S', 'R', 'E', 'C' };
+
+// Assembles the fragments of the wire encoding into a chunk, which is
+// self-contained so that it may be relayed, stored and decoded by any
+// process.  Values are in native byte order:
+//
+//   chunk   := magic:char[4] version:uint32 numNames:uint32
+//              numMessages:uint32 string{numNames} message*
+//   message := eventType:int32 messageType:name topic:string
+//              numCids:uint32 cid* value
+//   name    := uint32 index into the strings of the chunk
+//
+// where 'string', 'cid' and 'value' are as in 'EventBuffer'.  A chunk
+// carries every name of the dictionary up to the highest id used by its
+// messages.
+class WireEncoder {
+public:
+    static const char MAGIC[4];
+    static const uint32_t VERSION = 1;
+    static const size_t HEADER_SIZE = 16;
+
+    explicit WireEncoder(const WireDictionary& dictionary)
+        : d_dictionary(dictionary), d_names(0), d_names_size(0),
+          d_messages(0) {}
+
+    // Append the messages of 'fragment'.
+    void append(const WireFragment& fragment);
+
+    uint32_t numMessages() const { return d_messages; }
+
+    // Return the size of the chunk, and copy it to 'out'.
+    size_t size() const {
+        return HEADER_SIZE + d_names_size + d_body.size();
     }
-    if (args.Length() < 2 || !args[1]->IsString()) {
-        return ThrowException(Exception::Error(String::New(
-                "String request name must be provided as second parameter.")));
+    void copyTo(char* out) const;
+
+    // Start the next chunk.
+    void clear();
+
+private:
+    WireEncoder(const WireEncoder&);
+    WireEncoder& operator=(const WireEncoder&);
+
+    const WireDictionary& d_dictionary;
+    uint32_t d_names;
+    size_t d_names_size;
+    std::vector<char> d_body;
+    uint32_t d_messages;
+};
+
+const char WireEncoder::MAGIC[4] = { 'B', 'L', 'P', 'W' };
+
+// Shape and pace of the market data synthesized by an offline session,
+// disabled when 'topics' is zero.
+struct SyntheticFeed {
+    int topics;
+    int fields;
+    int messagesPerEvent;
+    double rate;
+    double count;
+
+    SyntheticFeed()
+        : topics(0), fields(6), messagesPerEvent(1), rate(0), count(0) {}
+};
+
+// Histogram of latencies in nanoseconds, each power of two split into
+// eight buckets.
+class LatencyHistogram {
+public:
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t ns) {
+        ++d_counts[bucket(ns)];
+        ++d_count;
+        d_sum += ns;
+        if (ns < d_min || 1 == d_count)
+            d_min = ns;
+        if (ns > d_max)
+            d_max = ns;
     }
-    if (args.Length() < 3 || !args[2]->IsObject()) {
-        return ThrowException(Exception::Error(String::New(
-                "Object containing request parameters must be provided "
-                "as third parameter.")));
+
+    void reset() {
+        memset(d_counts, 0, sizeof(d_counts));
+        d_count = d_sum = d_min = d_max = 0;
     }
-    if (args.Length() < 4 || !args[3]->IsInt32()) {
-        return ThrowException(Exception::Error(String::New(
-                "Integer correlation identifier must be provided "
-                "as fourth parameter.")));
+
+    uint64_t count() const { return d_count; }
+    uint64_t sum() const { return d_sum; }
+    uint64_t min() const { return d_min; }
+    uint64_t max() const { return d_max; }
+
+    // Return the upper bound of the bucket holding the 'q' quantile.
+    uint64_t quantile(double q) const;
+
+private:
+    enum { SUB_BITS = 3, SUB_COUNT = 1 << SUB_BITS, NUM_BUCKETS = 64 * 8 };
+
+    static unsigned bucket(uint64_t ns) {
+        if (ns < SUB_COUNT)
+            return ns;
+        unsigned shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + ((ns >> shift) & (SUB_COUNT - 1));
     }
-    if (args.Length() >= 5 && !args[4]->IsUndefined() && !args[4]->IsString()) {
-        return ThrowException(Exception::Error(String::New(
-                "Optional request label must be a string.")));
+
+    uint64_t d_counts[NUM_BUCKETS];
+    uint64_t d_count;
+    uint64_t d_sum;
+    uint64_t d_min;
+    uint64_t d_max;
+};
+
+uint64_t
+LatencyHistogram::quantile(double q) const
+{
+    if (0 == d_count)
+        return 0;
+
+    uint64_t rank = static_cast<uint64_t>(q * (d_count - 1)) + 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < NUM_BUCKETS; ++i) {
+        seen += d_counts[i];
+        if (seen < rank)
+            continue;
+        if (i < SUB_COUNT)
+            return i;
+        unsigned shift = i / SUB_COUNT - 1;
+        uint64_t upper = (static_cast<uint64_t>(SUB_COUNT + i % SUB_COUNT + 1)
+                          << shift) - 1;
+        return upper < d_max ? upper : d_max;
     }
-    if (args.Length() > 5) {
-        return ThrowException(Exception::Error(String::New(
-                "Function expects at most five arguments.")));
+    return d_max;
+}
+
+// Latencies of the events of one type, in the stages reported by
+// 'stats().latency'.
+struct EventLatency {
+    LatencyHistogram queue;
+    LatencyHistogram dispatch;
+    LatencyHistogram total;
+};
+
+// Latencies of the messages of one type.
+struct MessageLatency {
+    LatencyHistogram dispatch;
+    LatencyHistogram total;
+};
+
+// Bounded lock-free queue of 'QueuedEvent's, pushed by any number of
+// dispatcher threads and popped by the libuv thread alone.
+class EventQueue {
+public:
+    explicit EventQueue(size_t capacity);
+    ~EventQueue();
+
+    // Enqueue 'ev', returning false without blocking if the queue is full.
+    bool push(const QueuedEvent& ev);
+
+    // Dequeue the head into 'ev', returning false if the queue is empty.
+    bool pop(QueuedEvent* ev);
+
+    size_t capacity() const { return d_mask + 1; }
+    uint64_t enqueued() const { return d_enqueued; }
+
+    // Number of slots ever claimed by producers, which is the position
+    // of the next event pushed.
+    size_t claimed() const { return d_head; }
+
+    // Number of events claimed by producers and not yet dequeued.
+    size_t depth() const {
+        size_t tail = d_tail;
+        __sync_synchronize();
+        return d_head - tail;
     }
+    uint64_t dequeued() const { return d_dequeued; }
 
-    int cidi = args[3]->Int32Value();
+private:
+    EventQueue(const EventQueue&);
+    EventQueue& operator=(const EventQueue&);
+
+    struct Slot {
+        volatile size_t d_seq;
+        QueuedEvent d_event;
+    };
+
+    Slot *d_slots;
+    size_t d_mask;
+
+    // Keep the producer and consumer positions on separate cache lines.
+    char d_pad0[64];
+    volatile size_t d_head;
+    volatile uint64_t d_enqueued;
+    char d_pad1[64];
+    volatile size_t d_tail;
+    volatile uint64_t d_dequeued;
+    char d_pad2[64];
+};
 
-    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+EventQueue::EventQueue(size_t capacity)
+    : d_head(0)
+    , d_enqueued(0)
+    , d_tail(0)
+    , d_dequeued(0)
+{
+    // Round the capacity up to a power of two so positions wrap by mask.
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    d_mask = size - 1;
+    d_slots = new Slot[size];
+    for (size_t i = 0; i < size; ++i)
+        d_slots[i].d_seq = i;
+}
 
-    BLPAPI_EXCEPTION_TRY
+EventQueue::~EventQueue()
+{
+    // Free the buffers of the events never dequeued.
+    QueuedEvent ev;
+    while (pop(&ev))
+        ev.release();
+    delete [] d_slots;
+}
 
-    Local<String> uri = args[0]->ToString();
-    std::vector<char> uriv;
-    uriv.reserve(uri->Length() + 1);
-    uri->WriteAscii(&uriv[0]);
+bool
+EventQueue::push(const QueuedEvent& ev)
+{
+    size_t pos = d_head;
+    Slot *slot;
+    for (;;) {
+        slot = &d_slots[pos & d_mask];
+        size_t seq = slot->d_seq;
+        __sync_synchronize();
+        ssize_t diff = static_cast<ssize_t>(seq) - static_cast<ssize_t>(pos);
+        if (0 == diff) {
+            // Slot is free for this lap; claim it by advancing the head.
+            if (__sync_bool_compare_and_swap(&d_head, pos, pos + 1))
+                break;
+            pos = d_head;
+        } else if (diff < 0) {
+            // Slot still holds an event from the previous lap.
+            return false;
+        } else {
+            pos = d_head;
+        }
+    }
 
-    blpapi::Service service = session->d_session->getService(&uriv[0]);
+    slot->d_event = ev;
+    __sync_synchronize();
+    slot->d_seq = pos + 1;
 
-    Local<String> name = args[1]->ToString();
-    std::vector<char> namev;
-    namev.reserve(name->Utf8Length() + 1);
-    name->WriteUtf8(&namev[0]);
+    __sync_fetch_and_add(&d_enqueued, 1);
+    return true;
+}
 
-    blpapi::Request request = service.createRequest(&namev[0]);
+bool
+EventQueue::pop(QueuedEvent* ev)
+{
+    size_t pos = d_tail;
+    Slot *slot = &d_slots[pos & d_mask];
+    size_t seq = slot->d_seq;
+    __sync_synchronize();
+    if (seq != pos + 1)
+        return false;
+
+    *ev = slot->d_event;
+    slot->d_event = QueuedEvent();
+    __sync_synchronize();
+    slot->d_seq = pos + d_mask + 1;
+
+    d_tail = pos + 1;
+    ++d_dequeued;
+    return true;
+}
 
-    // Loop over object properties, appending/setting into the request.
-    Local<Object> obj = args[2]->ToObject();
-    Local<Array> props = obj->GetPropertyNames();
+// What a session does while its event queue is above the high watermark.
+enum OverflowPolicy {
+    OVERFLOW_BLOCK,        // Block dispatcher threads with SUBSCRIPTION_DATA
+    OVERFLOW_DROP_OLDEST,  // Discard the oldest queued SUBSCRIPTION_DATA
+    OVERFLOW_CONFLATE      // Conflate all SUBSCRIPTION_DATA
+};
 
-    for (int i = 0; i < props->Length(); ++i) {
-        // Process the key.
-        Local<Value> keyval = props->Get(i);
-        Local<String> key = keyval->ToString();
-        std::vector<char> keyv;
-        keyv.reserve(key->Utf8Length() + 1);
-        key->WriteUtf8(&keyv[0]);
+class Session : public ObjectWrap,
+                public blpapi::EventHandler {
+public:
+    Session(const char *host, int port, size_t queueSize,
+            int dispatchThreads);
+    ~Session();
 
-        // Process the value.
-        //
-        // The values present on the outer object are marshalled into the
-        // blpapi::Request by setting values using 'set'.  Arrays indicate
-        // values which should be marshalled using 'append'.
-        Local<Value> val = obj->Get(keyval);
-        if (val->IsString()) {
-            Local<String> s = val->ToString();
-            std::vector<char> valv;
-            valv.reserve(s->Utf8Length() + 1);
-            s->WriteUtf8(&valv[0]);
-            request.set(&keyv[0], &valv[0]);
-        } else if (val->IsBoolean()) {
-            request.set(&keyv[0], val->BooleanValue());
-        } else if (val->IsNumber()) {
-            request.set(&keyv[0], val->NumberValue());
-        } else if (val->IsInt32()) {
-            request.set(&keyv[0], val->Int32Value());
-        } else if (val->IsUint32()) {
-            request.set(&keyv[0],
-                static_cast<blpapi::Int64>(val->Uint32Value()));
-        } else if (val->IsDate()) {
-            blpapi::Datetime dt;
-            mkdatetime(&dt, val);
-            request.set(&keyv[0], dt);
-        } else if (val->IsArray()) {
-            // Arrays are marshalled into the blpapi::Request by appending
-            // value types using the key of the array in the outer object.
-            Local<Object> subarray = val->ToObject();
-            int jmax = Array::Cast(*val)->Length();
-            for (int j = 0; j < jmax; ++j) {
-                Local<Value> subval = subarray->Get(j);
-                // Only strings, booleans, and numbers are marshalled.
-                if (subval->IsString()) {
-                    Local<String> s = subval->ToString();
-                    std::vector<char> subvalv;
-                    subvalv.reserve(s->Utf8Length() + 1);
-                    s->WriteUtf8(&subvalv[0]);
-                    request.append(&keyv[0], &subvalv[0]);
-                } else if (subval->IsBoolean()) {
-                    request.append(&keyv[0], subval->BooleanValue());
-                } else if (subval->IsNumber()) {
-                    request.append(&keyv[0], subval->NumberValue());
-                } else if (subval->IsInt32()) {
-                    request.append(&keyv[0], subval->Int32Value());
-                } else if (subval->IsUint32()) {
-                    request.append(&keyv[0],
-                        static_cast<blpapi::Int64>(subval->Uint32Value()));
-                } else if (subval->IsDate()) {
-                    blpapi::Datetime dt;
-                    mkdatetime(&dt, subval);
-                    request.append(&keyv[0], dt);
-                } else {
+    static void Initialize(Handle<Object> target);
+    static Handle<Value> New(const Arguments& args);
+
+    static Handle<Value> Start(const Arguments& args);
+    static Handle<Value> Stop(const Arguments& args);
+    static Handle<Value> Destroy(const Arguments& args);
+    static Handle<Value> OpenService(const Arguments& args);
+    static Handle<Value> Subscribe(const Arguments& args);
+    static Handle<Value> Resubscribe(const Arguments& args);
+    static Handle<Value> SubscribeBulk(const Arguments& args);
+    static Handle<Value> Unsubscribe(const Arguments& args);
+    static Handle<Value> ApplyUniverse(const Arguments& args);
+    static Handle<Value> Snapshot(const Arguments& args);
+    static Handle<Value> Request(const Arguments& args);
+    static Handle<Value> PrepareRequest(const Arguments& args);
+    static Handle<Value> Stats(const Arguments& args);
+    static Handle<Value> DecodeWire(const Arguments& args);
+
+private:
+    Session();
+    Session(const Session&);
+    Session& operator=(const Session&);
+
+    static Handle<Value> subscribe(const Arguments& args, bool resubscribe);
+
+    // Register 'registrations' and send 'sl', which subscribes to them,
+    // rolling the registrations back if the send throws.
+    void sendSubscriptions(const blpapi::SubscriptionList& sl,
+                           const RegistrationList& registrations,
+                           Handle<Value> label, bool resubscribe);
+
+    // Register 'registrations', loading into the optional 'previous' the
+    // registrations they replace, which 'restoreSubscriptions' puts back.
+    void updateSubscriptions(const RegistrationList& registrations,
+                             std::map<int, Registration>* previous = 0);
+    void restoreSubscriptions(const RegistrationList& registrations,
+                              const std::map<int, Registration>& previous);
+    void removeSubscriptions(const std::vector<int>& correlations);
+    void pruneSubscriptions(blpapi_Name_t* messageType,
+                            Handle<Object> message);
+
+    // Return 'correlation' with the class id it is registered with, or
+    // zero if it is not.
+    blpapi::CorrelationId registeredCorrelationId(int correlation) const;
+    static const char* formRegistration(int* correlation,
+                                        Registration* registration,
+                                        Handle<Value> value);
+    static const char* formSubscription(std::string* fields,
+                                        std::string* options,
+                                        Subscription* subscription,
+                                        Handle<Object> object);
+    static void formFields(std::string* str, Handle<Object> array);
+    static void formOptions(std::string* str, Handle<Value> array);
+    static void formNames(std::vector<blpapi::Name>* names,
+                          Handle<Object> array);
+    Handle<Value> elementToValue(const blpapi::Element& e);
+    Handle<Value> elementValueToValue(const blpapi::Element& e, int idx = 0);
+    Handle<String> stringToValue(const char* str);
+    Handle<Value> elementToColumns(const blpapi::Element& e);
+    Handle<Value> projectionToValue(
+            const blpapi::Element& e,
+            const std::vector<blpapi::Name>& projection);
+
+    // Javascript view of an element whose sub-elements are decoded only
+    // when first accessed.  Holds a reference to the owning event, which
+    // keeps the element valid, and to the session, which decodes it.
+    class LazyElement : public ObjectWrap {
+    public:
+        LazyElement(Session* session, const blpapi::Event& ev,
+                    const blpapi::Element& element);
+        ~LazyElement();
+
+        static Handle<Value> Get(Local<String> property,
+                                 const AccessorInfo& info);
+        static Handle<Integer> Query(Local<String> property,
+                                     const AccessorInfo& info);
+        static Handle<Array> Enumerate(const AccessorInfo& info);
+
+        void wrap(Handle<Object> object) { Wrap(object); }
+
+    private:
+        bool find(blpapi::Element* element, Local<String> property);
+
+        Session *d_session;
+        blpapi::Event d_event;
+        blpapi::Element d_element;
+        Persistent<Object> d_cache;
+    };
+
+    Handle<Value> lazyElementToValue(const blpapi::Event& ev,
+                                     const blpapi::Element& e);
+
+    // Marks 'ev' as the event being decoded for the lifetime of the
+    // guard, so that its long strings may be wrapped rather than copied.
+    class DecodingEvent {
+    public:
+        DecodingEvent(Session* session, const blpapi::Event& ev)
+            : d_session(session), d_previous(session->d_decode_event) {
+            session->d_decode_event = &ev;
+        }
+        ~DecodingEvent() { d_session->d_decode_event = d_previous; }
+
+    private:
+        Session *d_session;
+        const blpapi::Event *d_previous;
+    };
+
+    // A request whose service, operation, element names and element types
+    // are resolved once, so that repeated requests of the same shape only
+    // marshal their values.
+    class PreparedRequest : public ObjectWrap {
+    public:
+        PreparedRequest(Session* session, const blpapi::Service& service,
+                        const char* operation);
+        ~PreparedRequest();
+
+        static Handle<Value> Send(const Arguments& args);
+
+        void wrap(Handle<Object> object) { Wrap(object); }
+
+        // Add the element described by 'def' under the property 'key',
+        // sent as 'defaultValue' when not given a value.  Return false if
+        // the element type can not be marshalled.
+        bool addField(Handle<String> key, Handle<Value> defaultValue,
+                      const blpapi::SchemaElementDefinition& def);
+
+    private:
+        struct Field {
+            Persistent<String> key;
+            Persistent<Value> defaultValue;
+            blpapi::Name name;
+            int datatype;
+            bool isArray;
+        };
+
+        bool setValue(blpapi::Request* request, const Field& field,
+                      Handle<Value> value, bool append);
+
+        Session *d_session;
+        blpapi::Service d_service;
+        std::string d_operation;
+        std::vector<Field> d_fields;
+        std::vector<char> d_buffer;
+    };
+
+    Handle<Value> bufferToValue(EventBuffer::Reader* reader);
+    static bool wireToMessages(EventBuffer::Cursor* cursor,
+                               Handle<Array> messages);
+    static Handle<Value> wireToValue(EventBuffer::Cursor* cursor,
+                                     const std::vector<Local<String> >& names,
+                                     int depth);
+
+    static Handle<String> eventTypeToString(blpapi::Event::EventType et);
+
+    // Return a new message envelope, whose 'data' is set by the caller,
+    // or correlation id.  Both are created from templates so that every
+    // one shares the same layout.
+    static Local<Object> newMessage(blpapi::Event::EventType et,
+                                    Handle<String> messageType,
+                                    Handle<String> topic,
+                                    Handle<Array> correlations);
+    static Local<Object> correlationToValue(int64_t value, int classId);
+    Handle<String> nameToString(const blpapi::Name& name);
+    Handle<String> nameToString(blpapi_Name_t* name);
+    Handle<String> topicToString(const char* topic);
+
+    bool processEvent(const blpapi::Event& ev, blpapi::Session* session);
+
+    // Apply the watermarks and the 'block' overflow policy to an event of
+    // 'eventType' about to be queued by a producer thread.
+    void admit(int eventType);
+
+    // Replace the pre-decoded subscription data of 'qe' with its wire
+    // encoding, if the session delivers it so.
+    void encodeWire(QueuedEvent* qe);
+
+    // Attach to 'qe' the pending conflated update of the subscription of
+    // 'msg', or of 'correlation', if any, to be delivered ahead of it.
+    void takeConflated(QueuedEvent* qe, const blpapi::Message& msg);
+    void takeConflated(QueuedEvent* qe, int correlation);
+    static void processEvents(uv_async_t *async, int status);
+    static void closeAsync(uv_handle_t *handle);
+    static void closeTimer(uv_handle_t *handle);
+    static void timerExpired(uv_timer_t *timer, int status);
+    void updatePeakDepth();
+
+    // Push 'qe' from a producer thread, waiting while the queue is full
+    // for the libuv thread to free a slot.  Return false, without
+    // pushing, if the session is being destroyed.
+    bool enqueue(const QueuedEvent& qe);
+    void waitForDrain(pthread_cond_t* cond);
+    void broadcast(pthread_cond_t* cond);
+
+    // Replay of a recording or synthesis of market data, run on its own
+    // thread in place of the BLPAPI session.
+    static void* replayEvents(void* arg);
+    static void* synthesizeEvents(void* arg);
+    void replay();
+    void synthesize();
+    void waitUntil(uint64_t due);
+    void finishOffline();
+    void pushReplayed(int eventType, EventBuffer* buffer);
+
+    // A field of a message encoded in an 'EventBuffer', whose encoded
+    // value spans 'length' bytes at 'value'.
+    struct EncodedField {
+        blpapi_Name_t *name;
+        const char *value;
+        size_t length;
+    };
+
+    // Apply the subscription settings to the replayed event 'qe' as
+    // 'processEvent' does to received events, re-encoding its buffer
+    // without the messages conflated, cached only or aggregated, and with
+    // the fields of projected subscriptions only.  Return false if no
+    // message is left to deliver.
+    bool filterReplayed(QueuedEvent* qe);
+
+    bool addTick(const blpapi::Message& msg, const Subscription::Bars& bars,
+                 bool* wake);
+    Local<Object> latencyToValue();
+    void resetLatency();
+    Local<Object> messageToValue(const blpapi::Event& ev,
+                                 const blpapi::Message& msg);
+    Local<Object> bufferToMessage(blpapi::Event::EventType et,
+                                  EventBuffer::Reader* reader,
+                                  blpapi_Name_t** messageType);
+
+    // Messages of the same type awaiting delivery as one array.
+    struct PendingBatch {
+        blpapi_Name_t *type;
+        Local<Array> messages;
+        uint32_t length;
+
+        PendingBatch() : type(0), length(0) {}
+    };
+
+    void deliver(PendingBatch* batch, blpapi::Event::EventType et,
+                 blpapi_Name_t* messageType, Handle<Object> message);
+    void flushBatch(PendingBatch* batch);
+    void flushWire();
+    uint64_t flushConflations(PendingBatch* batch);
+    void deliverConflated(PendingBatch* batch,
+                          const std::vector<ConflatedUpdate>& updates);
+    uint64_t flushBars(PendingBatch* batch);
+    uint64_t recordMessageLatency(const QueuedEvent& qe,
+                                  blpapi_Name_t* messageType, uint64_t begin);
+    void checkWatermarks(PendingBatch* batch);
+    void notifySlowConsumer(PendingBatch* batch, bool slow);
+
+    void emit(int argc, Handle<Value> argv[]);
+
+    static Persistent<String> s_emit;
+    static Persistent<String> s_event_type;
+    static Persistent<String> s_message_type;
+    static Persistent<String> s_topic_name;
+    static Persistent<String> s_correlations;
+    static Persistent<String> s_value;
+    static Persistent<String> s_class_id;
+    static Persistent<String> s_data;
+    static Persistent<String> s_security;
+    static Persistent<String> s_fields;
+    static Persistent<String> s_options;
+    static Persistent<String> s_correlation;
+    static Persistent<String> s_projection;
+    static Persistent<String> s_project;
+    static Persistent<String> s_conflate;
+    static Persistent<String> s_cache;
+    static Persistent<String> s_bars;
+
+    // Names of the event types indexed by type, with 'UNKNOWN' at index
+    // zero, which no event type uses.
+    static Persistent<String> s_event_types[blpapi::Event::REQUEST + 1];
+    static Persistent<String> s_wire_data;
+    static Persistent<Function> s_float64_array;
+    static Persistent<Function> s_array_buffer;
+    static Persistent<ObjectTemplate> s_lazy_template;
+    static Persistent<ObjectTemplate> s_message_template;
+    static Persistent<ObjectTemplate> s_correlation_template;
+    static Persistent<FunctionTemplate> s_prepared_request;
+
+    // Interned strings for the names and topics seen by this session.
+    // Names are keyed by their 'blpapi_Name_t' handle, which BLPAPI keeps
+    // unique per name for the life of the process.  Topic keys are owned
+    // copies of the topic string.
+    typedef std::map<blpapi_Name_t*, Persistent<String> > NameMap;
+    typedef std::map<const char*, Persistent<String>, CStringLess> TopicMap;
+
+    // A column of a columnar decode; 'data' points into the 'values'
+    // Float64Array for numeric columns and is null for value columns.
+    struct Column {
+        blpapi::Name name;
+        Local<Object> values;
+        double *data;
+    };
+
+    blpapi::SessionOptions d_options;
+    blpapi::EventDispatcher *d_dispatcher;
+    blpapi::Session *d_session;
+    Persistent<Object> d_session_ref;
+    uv_async_t *d_async;
+    uv_timer_t *d_timer;
+    EventQueue d_que;
+    volatile uint64_t d_full_waits;
+
+    // Producers which find the queue full wait on 'd_drained', which the
+    // libuv thread signals as it frees slots.  Those blocked by the
+    // overflow policy wait on 'd_unblocked', signalled once the overload
+    // flag is lowered.  'd_waiters' and 'd_blocked' count them so that
+    // the libuv thread signals only when one waits.
+    pthread_mutex_t d_drain_mutex;
+    pthread_cond_t d_drained;
+    pthread_cond_t d_unblocked;
+    volatile int d_waiters;
+    volatile int d_blocked;
+
+    // Raised by 'destroy', after which producers give up waiting for the
+    // libuv thread, which no longer drains the queue.
+    volatile int d_destroying;
+
+    // Watermarks of the queue depth, zero when disabled.  'd_overloaded'
+    // is raised by dispatcher threads when the depth reaches the high
+    // watermark and lowered by the libuv thread once it has fallen to
+    // the low watermark.
+    size_t d_high_watermark;
+    size_t d_low_watermark;
+    OverflowPolicy d_overflow;
+    volatile int d_overloaded;
+    bool d_slow_notified;
+    uint64_t d_drains;
+    uint64_t d_slow_drain;
+    volatile size_t d_peak_depth;
+    volatile uint64_t d_blocked_waits;
+    uint64_t d_dropped;
+
+    // Budget of one drain of the queue, zero when unlimited.  Times are
+    // in nanoseconds.
+    uint32_t d_max_drain_messages;
+    uint64_t d_max_drain_time;
+    uint64_t d_yields;
+
+    // Latency histograms, only maintained when 'd_latency' is set.
+    bool d_latency;
+    std::map<int, EventLatency> d_event_latency;
+    std::map<blpapi_Name_t*, MessageLatency> d_message_latency;
+    bool d_started;
+    bool d_stopped;
+    bool d_batch;
+    uint32_t d_max_batch;
+    bool d_predecode;
+    bool d_lazy;
+
+    // Lazy data objects alive, each of which pins its BLPAPI event until
+    // collected.  Past 'd_max_lazy' of them, zero when unlimited, data is
+    // decoded eagerly instead, counted by 'd_lazy_eager'.
+    uint32_t d_max_lazy;
+    uint64_t d_lazy_pinned;
+    uint64_t d_lazy_eager;
+
+    // Subscription data is delivered in chunks of the wire encoding when
+    // 'd_wire' is set, of about 'WIRE_CHUNK_SIZE' bytes at most.
+    static const size_t WIRE_CHUNK_SIZE = 1 << 20;
+    bool d_wire;
+    WireDictionary d_wire_dictionary;
+    WireEncoder d_wire_encoder;
+    NameMap d_names;
+    TopicMap d_topics;
+    uint64_t d_interned;
+    std::set<int> d_columnar;
+    bool d_decode_columnar;
+
+    // Minimum length of the string values delivered as external strings
+    // over the memory of their event, zero when disabled, and the event
+    // being decoded, if any.
+    size_t d_external_strings;
+    const blpapi::Event *d_decode_event;
+
+    // Written only by the libuv thread, which may therefore read without
+    // locking.  Dispatcher threads must hold a read lock.
+    SubscriptionMap d_subscriptions;
+    pthread_rwlock_t d_subscriptions_lock;
+
+    // Every subscription made through this session, by correlation id.
+    // Used only by the libuv thread.
+    std::map<int, Registration> d_registry;
+    Conflator d_conflator;
+    LastValueCache d_cache;
+    BarAggregator d_bars;
+    blpapi::Name d_bar_name;
+    blpapi::Name d_subscription_failure;
+    blpapi::Name d_subscription_terminated;
+
+    // Recording of the events received.  An offline session instead
+    // replays a recording or synthesizes events, on its own thread in
+    // place of a connection.  'd_offline_stop' is raised to 1 by 'stop'
+    // and to 2 by 'destroy'.
+    EventRecorder d_recorder;
+    bool d_offline;
+    FILE *d_replay;
+    double d_replay_speed;
+    SyntheticFeed d_synthetic;
+    pthread_t d_offline_thread;
+    volatile int d_offline_stop;
+};
+
+Persistent<String> Session::s_emit;
+Persistent<String> Session::s_event_type;
+Persistent<String> Session::s_message_type;
+Persistent<String> Session::s_topic_name;
+Persistent<String> Session::s_correlations;
+Persistent<String> Session::s_value;
+Persistent<String> Session::s_class_id;
+Persistent<String> Session::s_data;
+Persistent<String> Session::s_security;
+Persistent<String> Session::s_fields;
+Persistent<String> Session::s_options;
+Persistent<String> Session::s_correlation;
+Persistent<String> Session::s_projection;
+Persistent<String> Session::s_project;
+Persistent<String> Session::s_conflate;
+Persistent<String> Session::s_cache;
+Persistent<String> Session::s_bars;
+Persistent<String> Session::s_event_types[blpapi::Event::REQUEST + 1];
+Persistent<String> Session::s_wire_data;
+Persistent<Function> Session::s_float64_array;
+Persistent<Function> Session::s_array_buffer;
+Persistent<ObjectTemplate> Session::s_lazy_template;
+Persistent<ObjectTemplate> Session::s_message_template;
+Persistent<ObjectTemplate> Session::s_correlation_template;
+Persistent<FunctionTemplate> Session::s_prepared_request;
+
+// Message types interned by every session when created, so that the
+// first message of each does not pay for creating its string.
+static const char *COMMON_MESSAGE_TYPES[] = {
+    "SessionStarted", "SessionStartupFailure", "SessionTerminated",
+    "SessionConnectionUp", "SessionConnectionDown", "ServiceOpened",
+    "ServiceOpenFailure", "SubscriptionStarted", "SubscriptionFailure",
+    "SubscriptionTerminated", "SubscriptionStreamsActivated",
+    "MarketDataEvents", "ReferenceDataResponse", "HistoricalDataResponse",
+    "IntradayBarResponse", "IntradayTickResponse", "fieldResponse",
+    "categorizedFieldResponse", "RequestFailure"
+};
+
+Session::Session(const char *host, int port, size_t queueSize,
+                 int dispatchThreads)
+    : d_dispatcher(0)
+    , d_session(0)
+    , d_async(0)
+    , d_timer(0)
+    , d_que(queueSize)
+    , d_full_waits(0)
+    , d_waiters(0)
+    , d_blocked(0)
+    , d_destroying(0)
+    , d_high_watermark(0)
+    , d_low_watermark(0)
+    , d_overflow(OVERFLOW_BLOCK)
+    , d_overloaded(0)
+    , d_slow_notified(false)
+    , d_drains(0)
+    , d_slow_drain(0)
+    , d_peak_depth(0)
+    , d_blocked_waits(0)
+    , d_dropped(0)
+    , d_max_drain_messages(0)
+    , d_max_drain_time(0)
+    , d_yields(0)
+    , d_latency(false)
+    , d_started(false)
+    , d_stopped(false)
+    , d_batch(false)
+    , d_max_batch(0)
+    , d_predecode(false)
+    , d_lazy(false)
+    , d_max_lazy(0)
+    , d_lazy_pinned(0)
+    , d_lazy_eager(0)
+    , d_wire(false)
+    , d_wire_encoder(d_wire_dictionary)
+    , d_interned(0)
+    , d_decode_columnar(false)
+    , d_external_strings(0)
+    , d_decode_event(0)
+    , d_offline(false)
+    , d_replay(0)
+    , d_replay_speed(1)
+    , d_offline_stop(0)
+{
+    d_options.setServerHost(host);
+    d_options.setServerPort(port);
+
+    BLPAPI_EXCEPTION_TRY
+    if (dispatchThreads > 1)
+        d_dispatcher = new blpapi::EventDispatcher(dispatchThreads);
+    d_session = new blpapi::Session(d_options, this, d_dispatcher);
+    d_bar_name = blpapi::Name("Bar");
+    nameToString(d_bar_name);
+    d_subscription_failure = blpapi::Name("SubscriptionFailure");
+    d_subscription_terminated = blpapi::Name("SubscriptionTerminated");
+    for (size_t i = 0; i < ARRAY_SIZE(COMMON_MESSAGE_TYPES); ++i)
+        nameToString(blpapi::Name(COMMON_MESSAGE_TYPES[i]));
+    BLPAPI_EXCEPTION_CATCH
+
+    pthread_rwlock_init(&d_subscriptions_lock, NULL);
+    pthread_mutex_init(&d_drain_mutex, NULL);
+    pthread_cond_init(&d_drained, NULL);
+    pthread_cond_init(&d_unblocked, NULL);
+
+    uv_ref(uv_default_loop());
+}
+
+Session::~Session()
+{
+    // Ref on the event loop is released in Destroy
+
+    pthread_rwlock_destroy(&d_subscriptions_lock);
+    pthread_mutex_destroy(&d_drain_mutex);
+    pthread_cond_destroy(&d_drained);
+    pthread_cond_destroy(&d_unblocked);
+
+    if (d_replay)
+        fclose(d_replay);
+
+    for (NameMap::iterator it = d_names.begin(); it != d_names.end(); ++it)
+        it->second.Dispose();
+    for (TopicMap::iterator it = d_topics.begin(); it != d_topics.end();
+         ++it) {
+        it->second.Dispose();
+        free(const_cast<char*>(it->first));
+    }
+}
+
+void
+Session::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+    Local<FunctionTemplate> t = FunctionTemplate::New(Session::New);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    NODE_SET_PROTOTYPE_METHOD(t, "start", Start);
+    NODE_SET_PROTOTYPE_METHOD(t, "stop", Stop);
+    NODE_SET_PROTOTYPE_METHOD(t, "destroy", Destroy);
+    NODE_SET_PROTOTYPE_METHOD(t, "openService", OpenService);
+    NODE_SET_PROTOTYPE_METHOD(t, "subscribe", Subscribe);
+    NODE_SET_PROTOTYPE_METHOD(t, "resubscribe", Resubscribe);
+    NODE_SET_PROTOTYPE_METHOD(t, "subscribeBulk", SubscribeBulk);
+    NODE_SET_PROTOTYPE_METHOD(t, "unsubscribe", Unsubscribe);
+    NODE_SET_PROTOTYPE_METHOD(t, "applyUniverse", ApplyUniverse);
+    NODE_SET_PROTOTYPE_METHOD(t, "snapshot", Snapshot);
+    NODE_SET_PROTOTYPE_METHOD(t, "request", Request);
+    NODE_SET_PROTOTYPE_METHOD(t, "prepareRequest", PrepareRequest);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
+
+    target->Set(String::NewSymbol("Session"), t->GetFunction());
+    NODE_SET_METHOD(target, "decodeWire", DecodeWire);
+
+    s_emit = NODE_PSYMBOL("emit");
+    s_event_type = NODE_PSYMBOL("eventType");
+    s_message_type = NODE_PSYMBOL("messageType");
+    s_topic_name = NODE_PSYMBOL("topicName");
+    s_correlations = NODE_PSYMBOL("correlations");
+    s_value = NODE_PSYMBOL("value");
+    s_class_id = NODE_PSYMBOL("classId");
+    s_data = NODE_PSYMBOL("data");
+    s_security = NODE_PSYMBOL("security");
+    s_fields = NODE_PSYMBOL("fields");
+    s_options = NODE_PSYMBOL("options");
+    s_correlation = NODE_PSYMBOL("correlation");
+    s_projection = NODE_PSYMBOL("projection");
+    s_project = NODE_PSYMBOL("project");
+    s_conflate = NODE_PSYMBOL("conflate");
+    s_cache = NODE_PSYMBOL("cache");
+    s_bars = NODE_PSYMBOL("bars");
+
+#define EVENT_TYPE_SYMBOL(e) \
+    s_event_types[blpapi::Event::e] = NODE_PSYMBOL(#e)
+
+    s_event_types[0] = NODE_PSYMBOL("UNKNOWN");
+    EVENT_TYPE_SYMBOL(ADMIN);
+    EVENT_TYPE_SYMBOL(SESSION_STATUS);
+    EVENT_TYPE_SYMBOL(SUBSCRIPTION_STATUS);
+    EVENT_TYPE_SYMBOL(REQUEST_STATUS);
+    EVENT_TYPE_SYMBOL(RESPONSE);
+    EVENT_TYPE_SYMBOL(PARTIAL_RESPONSE);
+    EVENT_TYPE_SYMBOL(SUBSCRIPTION_DATA);
+    EVENT_TYPE_SYMBOL(SERVICE_STATUS);
+    EVENT_TYPE_SYMBOL(TIMEOUT);
+    EVENT_TYPE_SYMBOL(AUTHORIZATION_STATUS);
+    EVENT_TYPE_SYMBOL(RESOLUTION_STATUS);
+    EVENT_TYPE_SYMBOL(TOPIC_STATUS);
+    EVENT_TYPE_SYMBOL(TOKEN_STATUS);
+    EVENT_TYPE_SYMBOL(REQUEST);
+
+#undef EVENT_TYPE_SYMBOL
+
+    s_wire_data = NODE_PSYMBOL("WireData");
+
+    s_float64_array = Persistent<Function>::New(Local<Function>::Cast(
+            Context::GetCurrent()->Global()->Get(
+                String::NewSymbol("Float64Array"))));
+    s_array_buffer = Persistent<Function>::New(Local<Function>::Cast(
+            Context::GetCurrent()->Global()->Get(
+                String::NewSymbol("ArrayBuffer"))));
+
+    Local<ObjectTemplate> lt = ObjectTemplate::New();
+    lt->SetInternalFieldCount(1);
+    lt->SetNamedPropertyHandler(LazyElement::Get, 0, LazyElement::Query,
+                                0, LazyElement::Enumerate);
+    s_lazy_template = Persistent<ObjectTemplate>::New(lt);
+
+    // Envelopes and correlation ids are instantiated with their properties
+    // in place, in a fixed order.  As when set one by one, the envelope
+    // properties other than 'data' are read only; 'newMessage' fills them
+    // with 'ForceSet'.
+    Local<ObjectTemplate> mt = ObjectTemplate::New();
+    mt->Set(s_event_type, Undefined(),
+            (PropertyAttribute)(ReadOnly | DontDelete));
+    mt->Set(s_message_type, Undefined(),
+            (PropertyAttribute)(ReadOnly | DontDelete));
+    mt->Set(s_topic_name, Undefined(),
+            (PropertyAttribute)(ReadOnly | DontDelete));
+    mt->Set(s_correlations, Undefined(),
+            (PropertyAttribute)(ReadOnly | DontDelete));
+    mt->Set(s_data, Undefined());
+    s_message_template = Persistent<ObjectTemplate>::New(mt);
+
+    Local<ObjectTemplate> ct = ObjectTemplate::New();
+    ct->Set(s_value, Undefined());
+    ct->Set(s_class_id, Undefined());
+    s_correlation_template = Persistent<ObjectTemplate>::New(ct);
+
+    Local<FunctionTemplate> pt = FunctionTemplate::New();
+    pt->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(pt, "send", PreparedRequest::Send);
+    s_prepared_request = Persistent<FunctionTemplate>::New(pt);
+}
+
+Handle<Value>
+Session::New(const Arguments& args)
+{
+    HandleScope scope;
+
+    char host[128] = "";
+    int port = 0;
+    bool batch = false;
+    int maxBatch = 0;
+    int queueSize = 8192;
+    int highWatermark = 0;
+    int lowWatermark = -1;
+    OverflowPolicy overflow = OVERFLOW_BLOCK;
+    int maxDrainMessages = 0;
+    double maxDrainTime = 0;
+    bool latency = false;
+    bool predecode = false;
+    int dispatchThreads = 1;
+    bool lazy = false;
+    int maxLazy = 10000;
+    bool wire = false;
+    int externalStrings = 0;
+    std::string record;
+    std::string replay;
+    double replaySpeed = 1;
+    SyntheticFeed synthetic;
+
+    if (args.Length() > 0 && args[0]->IsObject()) {
+        Local<Object> o = args[0]->ToObject();
+
+        // Capture the optional recording, replay and synthetic feed
+        // settings.  Offline sessions do not connect, so need no host.
+        Local<Value> rc = o->Get(String::New("record"));
+        if (!rc->IsUndefined()) {
+            if (!rc->IsString() || 0 == rc->ToString()->Length())
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'record' must be a file name.")));
+            record = *String::Utf8Value(rc);
+        }
+
+        Local<Value> rp = o->Get(String::New("replay"));
+        if (!rp->IsUndefined()) {
+            if (!rp->IsString() || 0 == rp->ToString()->Length())
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'replay' must be a file name.")));
+            replay = *String::Utf8Value(rp);
+        }
+
+        Local<Value> rs = o->Get(String::New("replaySpeed"));
+        if (!rs->IsUndefined()) {
+            if (!rs->IsNumber() || !(rs->NumberValue() >= 0))
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'replaySpeed' must be a "
+                            "non-negative number.")));
+            replaySpeed = rs->NumberValue();
+        }
+
+        Local<Value> sy = o->Get(String::New("synthetic"));
+        if (!sy->IsUndefined()) {
+            if (!sy->IsObject() || !replay.empty())
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'synthetic' must be an object, "
+                            "and can not be combined with 'replay'.")));
+            Local<Object> so = sy->ToObject();
+            synthetic.topics = 100;
+            const char *counts[] = { "topics", "fields", "messagesPerEvent" };
+            int *values[] = { &synthetic.topics, &synthetic.fields,
+                              &synthetic.messagesPerEvent };
+            for (size_t i = 0; i < ARRAY_SIZE(counts); ++i) {
+                Local<Value> v = so->Get(String::New(counts[i]));
+                if (v->IsUndefined())
+                    continue;
+                if (!v->IsInt32() || v->Int32Value() <= 0)
+                    return ThrowException(Exception::Error(String::Concat(
+                            String::New(counts[i]),
+                            String::New(" of the synthetic feed must be a "
+                                        "positive integer."))));
+                *values[i] = v->Int32Value();
+            }
+            Local<Value> sr = so->Get(String::New("rate"));
+            if (!sr->IsUndefined()) {
+                if (!sr->IsNumber() || !(sr->NumberValue() >= 0))
                     return ThrowException(Exception::Error(String::New(
-                                "Array contains invalid value type.")));
-                }
+                                "Synthetic feed 'rate' must be a "
+                                "non-negative number of events per "
+                                "second.")));
+                synthetic.rate = sr->NumberValue();
             }
-        } else {
+            Local<Value> sc = so->Get(String::New("count"));
+            if (!sc->IsUndefined()) {
+                if (!sc->IsNumber() || !(sc->NumberValue() >= 0))
+                    return ThrowException(Exception::Error(String::New(
+                                "Synthetic feed 'count' must be a "
+                                "non-negative number of events.")));
+                synthetic.count = floor(sc->NumberValue());
+            }
+        }
+        bool offline = !replay.empty() || synthetic.topics > 0;
+
+        // Capture the host name
+        Local<Value> h = o->Get(String::New("host"));
+        if (h->IsString()) {
+            h->ToString()->WriteAscii(host, 0, sizeof(host));
+            host[sizeof(host)-1] = '\0';
+        }
+        if (0 == host[0] && offline)
+            strcpy(host, "localhost");
+        if (0 == host[0])
             return ThrowException(Exception::Error(String::New(
-                        "Object contains invalid value type.")));
+                        "Configuration missing 'host'.")));
+
+        // Capture the port number
+        Local<Value> p = o->Get(String::New("port"));
+        if (p->IsInt32())
+            port = p->ToInt32()->Value();
+        if (0 == port && offline)
+            port = 8194;
+        if (0 == port)
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration missing non-zero 'port'.")));
+
+        // Capture the optional batched delivery settings
+        Local<Value> b = o->Get(String::New("batch"));
+        if (!b->IsUndefined() && !b->IsBoolean())
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration 'batch' must be a boolean.")));
+        batch = b->BooleanValue();
+
+        Local<Value> mb = o->Get(String::New("maxBatch"));
+        if (!mb->IsUndefined()) {
+            if (!mb->IsInt32() || mb->Int32Value() < 0)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'maxBatch' must be a "
+                            "non-negative integer.")));
+            maxBatch = mb->Int32Value();
+        }
+
+        // Capture the optional event queue capacity
+        Local<Value> qs = o->Get(String::New("queueSize"));
+        if (!qs->IsUndefined()) {
+            if (!qs->IsInt32() || qs->Int32Value() <= 0)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'queueSize' must be a "
+                            "positive integer.")));
+            queueSize = qs->Int32Value();
+        }
+
+        // Capture the optional queue watermarks and overflow policy
+        Local<Value> hw = o->Get(String::New("highWatermark"));
+        if (!hw->IsUndefined()) {
+            if (!hw->IsInt32() || hw->Int32Value() <= 0 ||
+                hw->Int32Value() > queueSize)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'highWatermark' must be a "
+                            "positive integer not above 'queueSize'.")));
+            highWatermark = hw->Int32Value();
+        }
+
+        Local<Value> lw = o->Get(String::New("lowWatermark"));
+        if (!lw->IsUndefined()) {
+            if (0 == highWatermark)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'lowWatermark' requires "
+                            "'highWatermark'.")));
+            if (!lw->IsInt32() || lw->Int32Value() < 0 ||
+                lw->Int32Value() >= highWatermark)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'lowWatermark' must be a "
+                            "non-negative integer below "
+                            "'highWatermark'.")));
+            lowWatermark = lw->Int32Value();
+        }
+
+        Local<Value> of = o->Get(String::New("overflow"));
+        if (!of->IsUndefined()) {
+            String::AsciiValue ofv(of);
+            if (of->IsString() && 0 == strcmp(*ofv, "block")) {
+                overflow = OVERFLOW_BLOCK;
+            } else if (of->IsString() && 0 == strcmp(*ofv, "dropOldest")) {
+                overflow = OVERFLOW_DROP_OLDEST;
+            } else if (of->IsString() && 0 == strcmp(*ofv, "conflate")) {
+                overflow = OVERFLOW_CONFLATE;
+            } else {
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'overflow' must be 'block', "
+                            "'dropOldest' or 'conflate'.")));
+            }
+        }
+
+        // Capture the optional budget of each drain of the queue
+        Local<Value> mdm = o->Get(String::New("maxDrainMessages"));
+        if (!mdm->IsUndefined()) {
+            if (!mdm->IsInt32() || mdm->Int32Value() < 0)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'maxDrainMessages' must be a "
+                            "non-negative integer.")));
+            maxDrainMessages = mdm->Int32Value();
+        }
+
+        Local<Value> mdt = o->Get(String::New("maxDrainTime"));
+        if (!mdt->IsUndefined()) {
+            if (!mdt->IsNumber() || !(mdt->NumberValue() >= 0))
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'maxDrainTime' must be a "
+                            "non-negative number of milliseconds.")));
+            maxDrainTime = mdt->NumberValue();
+        }
+
+        // Capture the optional latency measurement setting
+        Local<Value> lm = o->Get(String::New("latency"));
+        if (!lm->IsUndefined() && !lm->IsBoolean())
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration 'latency' must be a boolean.")));
+        latency = lm->BooleanValue();
+
+        // Capture the optional dispatcher thread decoding settings
+        Local<Value> pd = o->Get(String::New("predecode"));
+        if (!pd->IsUndefined() && !pd->IsBoolean())
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration 'predecode' must be a boolean.")));
+        predecode = pd->BooleanValue();
+
+        Local<Value> dt = o->Get(String::New("dispatchThreads"));
+        if (!dt->IsUndefined()) {
+            if (!dt->IsInt32() || dt->Int32Value() <= 0)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'dispatchThreads' must be a "
+                            "positive integer.")));
+            dispatchThreads = dt->Int32Value();
+        }
+
+        // Capture the optional lazy decoding setting
+        Local<Value> l = o->Get(String::New("lazy"));
+        if (!l->IsUndefined() && !l->IsBoolean())
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration 'lazy' must be a boolean.")));
+        lazy = l->BooleanValue();
+        if (lazy && predecode)
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration 'lazy' can not be combined with "
+                        "'predecode'.")));
+
+        Local<Value> ml = o->Get(String::New("maxLazy"));
+        if (!ml->IsUndefined()) {
+            if (!ml->IsInt32() || ml->Int32Value() < 0)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'maxLazy' must be a "
+                            "non-negative integer.")));
+            maxLazy = ml->Int32Value();
+        }
+
+        // Capture the optional wire encoding setting
+        Local<Value> w = o->Get(String::New("wire"));
+        if (!w->IsUndefined() && !w->IsBoolean())
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration 'wire' must be a boolean.")));
+        wire = w->BooleanValue();
+        if (wire && lazy)
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration 'wire' can not be combined with "
+                        "'lazy'.")));
+
+        // Capture the optional minimum length of external strings
+        Local<Value> es = o->Get(String::New("externalStrings"));
+        if (!es->IsUndefined()) {
+            if (!es->IsInt32() || es->Int32Value() < 0)
+                return ThrowException(Exception::Error(String::New(
+                            "Configuration 'externalStrings' must be a "
+                            "non-negative integer.")));
+            externalStrings = es->Int32Value();
+        }
+    } else {
+        return ThrowException(Exception::Error(String::New(
+                        "Configuration object must be passed as parameter.")));
+    }
+
+    // Open the recording to replay, checking its header
+    FILE *replayFile = 0;
+    if (!replay.empty()) {
+        replayFile = fopen(replay.c_str(), "rb");
+        char magic[sizeof(EventRecorder::MAGIC)];
+        uint32_t version;
+        if (!replayFile ||
+            1 != fread(magic, sizeof(magic), 1, replayFile) ||
+            1 != fread(&version, sizeof(version), 1, replayFile) ||
+            0 != memcmp(magic, EventRecorder::MAGIC, sizeof(magic)) ||
+            version != EventRecorder::VERSION) {
+            if (replayFile)
+                fclose(replayFile);
+            return ThrowException(Exception::Error(String::New(
+                        "Configuration 'replay' must name a readable "
+                        "recording.")));
+        }
+    }
+
+    Session *session = new Session(host, port, queueSize, dispatchThreads);
+    if (!record.empty() && !session->d_recorder.open(record.c_str())) {
+        if (replayFile)
+            fclose(replayFile);
+        uv_unref(uv_default_loop());
+        delete session;
+        return ThrowException(Exception::Error(String::New(
+                    "Configuration 'record' must name a writable file.")));
+    }
+    session->d_offline = replayFile || synthetic.topics > 0;
+    session->d_replay = replayFile;
+    session->d_synthetic = synthetic;
+    session->d_replay_speed = replaySpeed;
+    session->d_batch = batch;
+    session->d_max_batch = maxBatch;
+    session->d_predecode = predecode;
+    session->d_lazy = lazy;
+    session->d_max_lazy = maxLazy;
+    session->d_wire = wire;
+    session->d_external_strings = externalStrings;
+    session->d_high_watermark = highWatermark;
+    session->d_low_watermark = lowWatermark >= 0 ? lowWatermark
+                                                 : highWatermark / 2;
+    session->d_overflow = overflow;
+    session->d_max_drain_messages = maxDrainMessages;
+    session->d_max_drain_time = static_cast<uint64_t>(maxDrainTime * 1e6);
+    session->d_latency = latency;
+    session->Wrap(args.This());
+    return scope.Close(args.This());
+}
+
+Handle<Value>
+Session::Start(const Arguments& args)
+{
+    HandleScope scope;
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    if (session->d_started)
+        return ThrowException(Exception::Error(String::New(
+                        "Session has already been started.")));
+    if (session->d_stopped)
+        return ThrowException(Exception::Error(String::New(
+                        "Stopped sessions can not be restarted.")));
+
+    // Each session owns the async handle used to wake the event loop, so
+    // wakeups coalesced by libuv never drain another session's queue.
+    // The handle is heap allocated because it is released by libuv only
+    // after 'uv_close' completes.
+    session->d_async = new uv_async_t;
+    uv_async_init(uv_default_loop(), session->d_async, Session::processEvents);
+    session->d_async->data = session;
+    uv_unref(uv_default_loop());
+
+    // Timer used to deliver conflated updates and bars once they are due
+    session->d_timer = new uv_timer_t;
+    uv_timer_init(uv_default_loop(), session->d_timer);
+    session->d_timer->data = session;
+
+    std::string error;
+    try {
+        if (session->d_offline) {
+            // An offline session is fed by its own thread alone.
+            if (0 != pthread_create(&session->d_offline_thread, NULL,
+                                    session->d_replay
+                                        ? Session::replayEvents
+                                        : Session::synthesizeEvents,
+                                    session))
+                error = "Unable to start the offline thread.";
+        } else {
+            if (session->d_dispatcher)
+                session->d_dispatcher->start();
+            session->d_session->startAsync();
+        }
+    } catch (blpapi::Exception& e) {
+        error = e.description();
+    }
+    if (!error.empty()) {
+        uv_close(reinterpret_cast<uv_handle_t*>(session->d_async),
+                 Session::closeAsync);
+        session->d_async = 0;
+        uv_close(reinterpret_cast<uv_handle_t*>(session->d_timer),
+                 Session::closeTimer);
+        session->d_timer = 0;
+        return ThrowException(Exception::Error(
+                String::New(error.c_str(), error.length())));
+    }
+
+    session->d_session_ref = Persistent<Object>::New(args.This());
+    session->d_started = true;
+
+    return scope.Close(args.This());
+}
+
+Handle<Value>
+Session::Stop(const Arguments& args)
+{
+    HandleScope scope;
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    if (!session->d_started)
+        return ThrowException(Exception::Error(String::New(
+                        "Session has not been started.")));
+    if (session->d_stopped)
+        return ThrowException(Exception::Error(String::New(
+                        "Session has already been stopped.")));
+
+    session->d_stopped = true;
+
+    // The offline thread terminates the session once it sees the flag.
+    if (session->d_offline) {
+        __sync_bool_compare_and_swap(&session->d_offline_stop, 0, 1);
+        return scope.Close(args.This());
+    }
+
+    BLPAPI_EXCEPTION_TRY
+    session->d_session->stopAsync();
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    return scope.Close(args.This());
+}
+
+Handle<Value>
+Session::Destroy(const Arguments& args)
+{
+    HandleScope scope;
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    if (!session->d_started)
+        return ThrowException(Exception::Error(String::New(
+                        "Session has not been started.")));
+    if (!session->d_stopped)
+        return ThrowException(Exception::Error(String::New(
+                        "Session has not been stopped.")));
+
+    session->d_session_ref.Dispose();
+
+    // Producer threads may still be pushing events and waking the async
+    // handle, so must be stopped before it is closed.  The BLPAPI session
+    // is stopped synchronously, which waits for the callbacks in
+    // progress, and the threads of any dispatcher are joined.  Producers
+    // waiting for this thread, on a full queue or while blocked by the
+    // overflow policy, give up once 'd_destroying' is raised, so neither
+    // can deadlock.  The offline thread is joined.
+    session->d_destroying = 1;
+    session->broadcast(&session->d_drained);
+    session->broadcast(&session->d_unblocked);
+    if (session->d_offline) {
+        session->d_offline_stop = 2;
+        pthread_join(session->d_offline_thread, NULL);
+    } else {
+        try {
+            session->d_session->stop();
+        } catch (blpapi::Exception&) {
+        }
+        if (session->d_dispatcher)
+            session->d_dispatcher->stop(false);
+    }
+    session->d_recorder.close();
+
+    uv_close(reinterpret_cast<uv_handle_t*>(session->d_async),
+             Session::closeAsync);
+    session->d_async = 0;
+    uv_timer_stop(session->d_timer);
+    uv_close(reinterpret_cast<uv_handle_t*>(session->d_timer),
+             Session::closeTimer);
+    session->d_timer = 0;
+
+    uv_unref(uv_default_loop());
+
+    return scope.Close(args.This());
+}
+
+Handle<Value>
+Session::OpenService(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "Service URI string must be provided as first parameter.")));
+    }
+    if (args.Length() < 2 || !args[1]->IsInt32()) {
+        return ThrowException(Exception::Error(String::New(
+                "Integer correlation identifier must be provided "
+                "as second parameter.")));
+    }
+    if (args.Length() > 2) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most two arguments.")));
+    }
+
+    Local<String> s = args[0]->ToString();
+    std::vector<char> uriv;
+    uriv.reserve(s->Utf8Length() + 1);
+    s->WriteUtf8(&uriv[0]);
+
+    int cidi = args[1]->Int32Value();
+    blpapi::CorrelationId cid(cidi);
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    // Offline sessions have no services; a recording holds its own
+    // 'ServiceOpened' messages.
+    if (session->d_offline)
+        return scope.Close(Integer::New(cidi));
+
+    BLPAPI_EXCEPTION_TRY
+    session->d_session->openServiceAsync(&uriv[0], cid);
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    return scope.Close(Integer::New(cidi));
+}
+
+void
+Session::formFields(std::string* str, Handle<Object> object)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    assert(object->IsArray());
+
+    // Format each array value into the fields string "V[,V]"
+    str->clear();
+    for (int i = 0; i < Array::Cast(*object)->Length(); ++i) {
+        String::Utf8Value v(object->Get(i));
+        if (i > 0)
+            str->push_back(',');
+        str->append(*v, v.length());
+    }
+}
+
+void
+Session::formOptions(std::string* str, Handle<Value> value)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    if (value->IsUndefined() || value->IsNull())
+        return;
+
+    assert(value->IsObject());
+
+    std::stringstream ss;
+
+    if (value->IsArray()) {
+        // Format each array value into the options string "V[&V]"
+        Local<Object> object = value->ToObject();
+        for (int i = 0; i < Array::Cast(*object)->Length(); ++i) {
+            Local<String> key = object->Get(i)->ToString();
+            std::vector<char> valv;
+            valv.reserve(key->Utf8Length() + 1);
+            key->WriteUtf8(&valv[0]);
+            if (i > 0)
+                ss << "&";
+            ss << &valv[0];
+        }
+    } else {
+        // Format each KV pair into the options string "K=V[&K=V]"
+        Local<Object> object = value->ToObject();
+        Local<Array> keys = object->GetPropertyNames();
+        for (int i = 0; i < keys->Length(); ++i) {
+            Local<String> key = keys->Get(i)->ToString();
+            std::vector<char> keyv;
+            keyv.reserve(key->Utf8Length() + 1);
+            key->WriteUtf8(&keyv[0]);
+            if (i > 0)
+                ss << "&";
+            ss << &keyv[0] << "=";
+
+            Local<String> val = object->Get(key)->ToString();
+            std::vector<char> valv;
+            valv.reserve(val->Utf8Length() + 1);
+            val->WriteUtf8(&valv[0]);
+            ss << &valv[0];
+        }
+    }
+
+    *str = ss.str();
+}
+
+void
+Session::formNames(std::vector<blpapi::Name>* names, Handle<Object> object)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    assert(object->IsArray());
+
+    for (int i = 0; i < Array::Cast(*object)->Length(); ++i) {
+        Local<String> s = object->Get(i)->ToString();
+        std::vector<char> v;
+        v.resize(s->Utf8Length() + 1);
+        s->WriteUtf8(&v[0]);
+        names->push_back(blpapi::Name(&v[0]));
+    }
+}
+
+const char*
+Session::formSubscription(std::string* fields, std::string* options,
+                          Subscription* subscription, Handle<Object> object)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    // Process 'fields' array
+    Local<Value> fieldsv = object->Get(s_fields);
+    if (!fieldsv->IsArray())
+        return "Property 'fields' must be an array of strings.";
+    formFields(fields, fieldsv->ToObject());
+
+    // Process 'options' array
+    Local<Value> iv = object->Get(s_options);
+    if (!iv->IsUndefined() && !iv->IsNull() && !iv->IsObject()) {
+        return "Property 'options' must be an object containing "
+               "whose keys and key values will be configured as "
+               "options.";
+    }
+    formOptions(options, iv);
+
+    // Process optional 'project' flag or 'projection' array, naming
+    // the only fields to decode from the subscription's messages
+    iv = object->Get(s_projection);
+    if (!iv->IsUndefined()) {
+        if (!iv->IsArray())
+            return "Property 'projection' must be an array of strings.";
+        formNames(&subscription->projection, iv->ToObject());
+    } else {
+        iv = object->Get(s_project);
+        if (!iv->IsUndefined() && !iv->IsBoolean())
+            return "Property 'project' must be a boolean.";
+        if (iv->BooleanValue())
+            formNames(&subscription->projection, fieldsv->ToObject());
+    }
+
+    // Process optional 'conflate' flag or interval in milliseconds
+    iv = object->Get(s_conflate);
+    if (iv->IsBoolean()) {
+        subscription->conflate = iv->BooleanValue() ? 0 : -1;
+    } else if (iv->IsInt32() && iv->Int32Value() >= 0) {
+        subscription->conflate = iv->Int32Value();
+    } else if (!iv->IsUndefined()) {
+        return "Property 'conflate' must be a boolean or a "
+               "non-negative number of milliseconds.";
+    }
+
+    // Process optional 'cache' flag or 'only'
+    iv = object->Get(s_cache);
+    if (iv->IsBoolean()) {
+        subscription->cache = iv->BooleanValue() ? Subscription::CACHE
+                                                 : Subscription::CACHE_NONE;
+    } else if (iv->IsString() && 0 == strcmp(*String::AsciiValue(iv),
+                                              "only")) {
+        subscription->cache = Subscription::CACHE_ONLY;
+    } else if (!iv->IsUndefined()) {
+        return "Property 'cache' must be a boolean or 'only'.";
+    }
+
+    // Process optional 'bars' aggregation settings
+    iv = object->Get(s_bars);
+    if (!iv->IsUndefined()) {
+        if (!iv->IsObject())
+            return "Property 'bars' must be an object.";
+        Local<Object> bo = iv->ToObject();
+        Subscription::Bars& bars = subscription->bars;
+        static const struct {
+            const char *key;
+            Subscription::Bars::Kind kind;
+        } kinds[] = {
+            { "interval", Subscription::Bars::TIME },
+            { "volume", Subscription::Bars::VOLUME },
+            { "ticks", Subscription::Bars::TICKS }
+        };
+        for (size_t i = 0; i < ARRAY_SIZE(kinds); ++i) {
+            Local<Value> bv = bo->Get(String::New(kinds[i].key));
+            if (bv->IsUndefined())
+                continue;
+            if (bars.kind != Subscription::Bars::NONE || !bv->IsNumber() ||
+                !(bv->NumberValue() > 0)) {
+                return "Property 'bars' must have one positive 'interval', "
+                       "'volume' or 'ticks'.";
+            }
+            bars.kind = kinds[i].kind;
+            bars.size = bv->NumberValue();
+        }
+        if (bars.kind == Subscription::Bars::NONE) {
+            return "Property 'bars' must have one positive 'interval', "
+                   "'volume' or 'ticks'.";
+        }
+
+        Local<Value> pv = bo->Get(String::New("price"));
+        Local<Value> vv = bo->Get(String::New("size"));
+        if ((!pv->IsUndefined() && !pv->IsString()) ||
+            (!vv->IsUndefined() && !vv->IsString()))
+            return "Bar 'price' and 'size' must be field name strings.";
+        bars.price = blpapi::Name(pv->IsString()
+                                  ? *String::Utf8Value(pv) : "LAST_PRICE");
+        bars.volume = blpapi::Name(vv->IsString()
+                                   ? *String::Utf8Value(vv)
+                                   : "SIZE_LAST_TRADE");
+    }
+
+    return 0;
+}
+
+Handle<Value>
+Session::subscribe(const Arguments& args, bool resubscribe)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsArray()) {
+        return ThrowException(Exception::Error(String::New(
+                "Array of subscription information must be provided.")));
+    }
+    if (args.Length() >= 2 && !args[1]->IsUndefined() && !args[1]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "Optional subscription label must be a string.")));
+    }
+    if (args.Length() > 2) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most two arguments.")));
+    }
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    blpapi::SubscriptionList sl;
+    RegistrationList registrations;
+
+    Local<Object> o = args[0]->ToObject();
+    for (int i = 0; i < Array::Cast(*(args[0]))->Length(); ++i) {
+        int correlation;
+        Registration registration;
+        const char *error = formRegistration(&correlation, &registration,
+                                             o->Get(i));
+        if (error)
+            return ThrowException(Exception::Error(String::New(error)));
+
+        blpapi::CorrelationId cid =
+            session->registeredCorrelationId(correlation);
+        registration.classId = cid.classId();
+        sl.add(registration.security.c_str(), registration.fields.c_str(),
+               registration.options.c_str(), cid);
+        registrations.push_back(std::make_pair(correlation, registration));
+    }
+
+    BLPAPI_EXCEPTION_TRY
+    session->sendSubscriptions(sl, registrations,
+                               args.Length() == 2 ? args[1]
+                                                  : Handle<Value>(),
+                               resubscribe);
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    return scope.Close(args.This());
+}
+
+const char*
+Session::formRegistration(int* correlation, Registration* registration,
+                          Handle<Value> value)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    if (!value->IsObject()) {
+        return "Array elements must be objects "
+               "containing subscription information.";
+    }
+    Local<Object> io = value->ToObject();
+
+    // Process 'security' string
+    Local<Value> iv = io->Get(s_security);
+    if (!iv->IsString())
+        return "Property 'security' must be a string.";
+    String::Utf8Value secv(iv);
+    registration->security.assign(*secv, secv.length());
+
+    // Process 'fields', 'options' and the decoding settings
+    const char *error = formSubscription(&registration->fields,
+                                         &registration->options,
+                                         &registration->subscription, io);
+    if (error)
+        return error;
+
+    // Process 'correlation' int
+    iv = io->Get(s_correlation);
+    if (!iv->IsInt32())
+        return "Property 'correlation' must be an integer.";
+    *correlation = iv->Int32Value();
+
+    return 0;
+}
+
+void
+Session::sendSubscriptions(const blpapi::SubscriptionList& sl,
+                           const RegistrationList& registrations,
+                           Handle<Value> label, bool resubscribe)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    // The settings are registered before sending, so that dispatcher
+    // threads apply them to the very first ticks.
+    std::map<int, Registration> previous;
+    updateSubscriptions(registrations, &previous);
+
+    // Subscription data of offline sessions is replayed or synthesized.
+    if (d_offline)
+        return;
+
+    try {
+        if (!label.IsEmpty() && label->IsString()) {
+            String::Utf8Value labelv(label);
+            if (resubscribe)
+                d_session->resubscribe(sl, *labelv, labelv.length());
+            else
+                d_session->subscribe(sl, *labelv, labelv.length());
+        } else {
+            if (resubscribe)
+                d_session->resubscribe(sl);
+            else
+                d_session->subscribe(sl);
+        }
+    } catch (blpapi::Exception&) {
+        restoreSubscriptions(registrations, previous);
+        throw;
+    }
+}
+
+void
+Session::updateSubscriptions(const RegistrationList& registrations,
+                             std::map<int, Registration>* previous)
+{
+    if (previous) {
+        for (size_t i = 0; i < registrations.size(); ++i) {
+            std::map<int, Registration>::const_iterator it =
+                d_registry.find(registrations[i].first);
+            if (it != d_registry.end())
+                previous->insert(*it);
+        }
+    }
+
+    pthread_rwlock_wrlock(&d_subscriptions_lock);
+    for (size_t i = 0; i < registrations.size(); ++i) {
+        const Subscription& subscription =
+            registrations[i].second.subscription;
+        if (subscription.isDefault())
+            d_subscriptions.erase(registrations[i].first);
+        else
+            d_subscriptions[registrations[i].first] = subscription;
+    }
+    pthread_rwlock_unlock(&d_subscriptions_lock);
+
+    for (size_t i = 0; i < registrations.size(); ++i)
+        d_registry[registrations[i].first] = registrations[i].second;
+}
+
+void
+Session::restoreSubscriptions(const RegistrationList& registrations,
+                              const std::map<int, Registration>& previous)
+{
+    // Correlation ids registered before are restored, the others removed.
+    RegistrationList restored;
+    std::vector<int> removed;
+    for (size_t i = 0; i < registrations.size(); ++i) {
+        std::map<int, Registration>::const_iterator it =
+            previous.find(registrations[i].first);
+        if (it != previous.end())
+            restored.push_back(*it);
+        else
+            removed.push_back(registrations[i].first);
+    }
+    removeSubscriptions(removed);
+    updateSubscriptions(restored);
+}
+
+void
+Session::removeSubscriptions(const std::vector<int>& correlations)
+{
+    pthread_rwlock_wrlock(&d_subscriptions_lock);
+    for (size_t i = 0; i < correlations.size(); ++i)
+        d_subscriptions.erase(correlations[i]);
+    pthread_rwlock_unlock(&d_subscriptions_lock);
+
+    for (size_t i = 0; i < correlations.size(); ++i) {
+        d_registry.erase(correlations[i]);
+        d_conflator.remove(correlations[i]);
+        d_cache.remove(correlations[i]);
+        d_bars.remove(correlations[i]);
+    }
+}
+
+void
+Session::pruneSubscriptions(blpapi_Name_t* messageType,
+                            Handle<Object> message)
+{
+    // Use the HandleScope of the calling function for speed.
+    //
+    // Subscriptions which failed or were terminated no longer exist, and
+    // are dropped from the registry as if unsubscribed.
+    if (messageType != d_subscription_failure.impl() &&
+        messageType != d_subscription_terminated.impl())
+        return;
+
+    // Those of a topic since replaced carry an earlier class id, and leave
+    // the current subscription alone.
+    Local<Array> correlations =
+        Local<Array>::Cast(message->Get(s_correlations));
+    std::vector<int> removed;
+    for (uint32_t i = 0; i < correlations->Length(); ++i) {
+        Local<Object> cido = correlations->Get(i)->ToObject();
+        Local<Value> value = cido->Get(s_value);
+        if (!value->IsInt32())
+            continue;
+        std::map<int, Registration>::const_iterator it =
+            d_registry.find(value->Int32Value());
+        if (it != d_registry.end() &&
+            cido->Get(s_class_id)->Int32Value() == it->second.classId)
+            removed.push_back(it->first);
+    }
+    removeSubscriptions(removed);
+}
+
+blpapi::CorrelationId
+Session::registeredCorrelationId(int correlation) const
+{
+    std::map<int, Registration>::const_iterator it =
+        d_registry.find(correlation);
+    return blpapi::CorrelationId(correlation,
+                                 it != d_registry.end() ? it->second.classId
+                                                        : 0);
+}
+
+Handle<Value>
+Session::Subscribe(const Arguments& args)
+{
+    return Session::subscribe(args, false);
+}
+
+Handle<Value>
+Session::Resubscribe(const Arguments& args)
+{
+    return Session::subscribe(args, true);
+}
+
+Handle<Value>
+Session::SubscribeBulk(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsObject()) {
+        return ThrowException(Exception::Error(String::New(
+                "Object containing the shared subscription information "
+                "must be provided as first parameter.")));
+    }
+    if (args.Length() < 2 || !args[1]->IsArray()) {
+        return ThrowException(Exception::Error(String::New(
+                "Array of security strings must be provided as second "
+                "parameter.")));
+    }
+    if (args.Length() < 3 ||
+        !(args[2]->IsInt32() || args[2]->IsArray() ||
+          (args[2]->IsObject() &&
+           args[2]->ToObject()->HasIndexedPropertiesInExternalArrayData() &&
+           args[2]->ToObject()->GetIndexedPropertiesExternalArrayDataType()
+               == kExternalIntArray))) {
+        return ThrowException(Exception::Error(String::New(
+                "Array or Int32Array of correlation identifiers, or the "
+                "first of consecutive identifiers, must be provided as "
+                "third parameter.")));
+    }
+    if (args.Length() >= 4 && !args[3]->IsUndefined() &&
+        !args[3]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "Optional subscription label must be a string.")));
+    }
+    if (args.Length() > 4) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most four arguments.")));
+    }
+
+    // The fields, options and decoding settings are formed once and
+    // shared by every security.
+    Registration shared;
+    const char *error = formSubscription(&shared.fields, &shared.options,
+                                         &shared.subscription,
+                                         args[0]->ToObject());
+    if (error)
+        return ThrowException(Exception::Error(String::New(error)));
+
+    Local<Object> securities = args[1]->ToObject();
+    uint32_t length = Array::Cast(*args[1])->Length();
+
+    // Correlation ids come from a typed array, an array, or count up
+    // from a first id.
+    const int32_t *cidv = 0;
+    Local<Object> cido;
+    int first = 0;
+    if (args[2]->IsInt32()) {
+        first = args[2]->Int32Value();
+    } else {
+        cido = args[2]->ToObject();
+        int cidLength;
+        if (args[2]->IsArray()) {
+            cidLength = Array::Cast(*args[2])->Length();
+        } else {
+            cidv = static_cast<const int32_t*>(
+                    cido->GetIndexedPropertiesExternalArrayData());
+            cidLength = cido->GetIndexedPropertiesExternalArrayDataLength();
+        }
+        if (static_cast<uint32_t>(cidLength) != length) {
+            return ThrowException(Exception::Error(String::New(
+                    "Correlation identifiers must match the securities "
+                    "in number.")));
+        }
+    }
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    blpapi::SubscriptionList sl;
+    RegistrationList registrations;
+    registrations.reserve(length);
+    std::vector<char> secv;
+
+    for (uint32_t i = 0; i < length; ++i) {
+        Local<Value> sv = securities->Get(i);
+        if (!sv->IsString()) {
+            return ThrowException(Exception::Error(String::New(
+                        "Securities must be strings.")));
+        }
+        Local<String> s = sv->ToString();
+        secv.resize(s->Utf8Length() + 1);
+        s->WriteUtf8(&secv[0]);
+
+        int correlation;
+        if (cidv) {
+            correlation = cidv[i];
+        } else if (!cido.IsEmpty()) {
+            Local<Value> cv = cido->Get(i);
+            if (!cv->IsInt32()) {
+                return ThrowException(Exception::Error(String::New(
+                            "Correlation identifiers must be integers.")));
+            }
+            correlation = cv->Int32Value();
+        } else {
+            correlation = first + i;
+        }
+
+        blpapi::CorrelationId cid =
+            session->registeredCorrelationId(correlation);
+        sl.add(&secv[0], shared.fields.c_str(), shared.options.c_str(), cid);
+        registrations.push_back(std::make_pair(correlation, shared));
+        registrations.back().second.security.assign(&secv[0],
+                                                    secv.size() - 1);
+        registrations.back().second.classId = cid.classId();
+    }
+
+    BLPAPI_EXCEPTION_TRY
+    session->sendSubscriptions(sl, registrations,
+                               args.Length() == 4 ? args[3]
+                                                  : Handle<Value>(),
+                               false);
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    return scope.Close(args.This());
+}
+
+Handle<Value>
+Session::Unsubscribe(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsArray()) {
+        return ThrowException(Exception::Error(String::New(
+                "Array of correlation identifiers must be provided.")));
+    }
+    if (args.Length() > 1) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most one argument.")));
+    }
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    blpapi::SubscriptionList sl;
+    std::vector<int> correlations;
+
+    Local<Object> o = args[0]->ToObject();
+    for (uint32_t i = 0; i < Array::Cast(*args[0])->Length(); ++i) {
+        Local<Value> v = o->Get(i);
+        if (!v->IsInt32()) {
+            return ThrowException(Exception::Error(String::New(
+                        "Correlation identifiers must be integers.")));
+        }
+        int correlation = v->Int32Value();
+
+        // BLPAPI unsubscribes by correlation id alone; the topic is only
+        // informative.
+        std::map<int, Registration>::const_iterator it =
+            session->d_registry.find(correlation);
+        sl.add(it != session->d_registry.end() ? it->second.security.c_str()
+                                               : "",
+               session->registeredCorrelationId(correlation));
+        correlations.push_back(correlation);
+    }
+
+    BLPAPI_EXCEPTION_TRY
+    if (!session->d_offline)
+        session->d_session->unsubscribe(sl);
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    session->removeSubscriptions(correlations);
+
+    return scope.Close(args.This());
+}
+
+Handle<Value>
+Session::ApplyUniverse(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsArray()) {
+        return ThrowException(Exception::Error(String::New(
+                "Array of subscription information must be provided.")));
+    }
+    if (args.Length() >= 2 && !args[1]->IsUndefined() &&
+        !args[1]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "Optional subscription label must be a string.")));
+    }
+    if (args.Length() > 2) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most two arguments.")));
+    }
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+    const std::map<int, Registration>& registry = session->d_registry;
+
+    // Diff the requested universe against the registry.  New correlation
+    // ids, and those whose security changed, are subscribed; those whose
+    // fields or options changed are resubscribed; those whose decoding
+    // settings alone changed are only updated; and those no longer
+    // present, or whose security changed, are unsubscribed.  A changed
+    // security is subscribed with the next class id, so that late status
+    // and data of the old topic can not be mistaken for the new one.
+    blpapi::SubscriptionList subscribeList;
+    blpapi::SubscriptionList resubscribeList;
+    blpapi::SubscriptionList unsubscribeList;
+    RegistrationList subscribed;
+    RegistrationList resubscribed;
+    RegistrationList updated;
+    std::vector<int> removed;
+    std::set<int> seen;
+
+    Local<Object> o = args[0]->ToObject();
+    for (uint32_t i = 0; i < Array::Cast(*args[0])->Length(); ++i) {
+        int correlation;
+        Registration registration;
+        const char *error = formRegistration(&correlation, &registration,
+                                             o->Get(i));
+        if (error)
+            return ThrowException(Exception::Error(String::New(error)));
+        if (!seen.insert(correlation).second) {
+            return ThrowException(Exception::Error(String::New(
+                        "Correlation identifiers must be unique.")));
+        }
+
+        std::map<int, Registration>::const_iterator it =
+            registry.find(correlation);
+        if (it == registry.end()) {
+            subscribeList.add(registration.security.c_str(),
+                              registration.fields.c_str(),
+                              registration.options.c_str(),
+                              blpapi::CorrelationId(correlation));
+            subscribed.push_back(std::make_pair(correlation, registration));
+            continue;
+        }
+
+        blpapi::CorrelationId cid(correlation, it->second.classId);
+        registration.classId = it->second.classId;
+        if (!it->second.sameTopic(registration)) {
+            unsubscribeList.add(it->second.security.c_str(), cid);
+            removed.push_back(correlation);
+            registration.classId = it->second.classId + 1;
+            subscribeList.add(registration.security.c_str(),
+                              registration.fields.c_str(),
+                              registration.options.c_str(),
+                              blpapi::CorrelationId(correlation,
+                                                    registration.classId));
+            subscribed.push_back(std::make_pair(correlation, registration));
+        } else if (!it->second.sameRequest(registration)) {
+            resubscribeList.add(registration.security.c_str(),
+                                registration.fields.c_str(),
+                                registration.options.c_str(), cid);
+            resubscribed.push_back(std::make_pair(correlation,
+                                                  registration));
+        } else if (!it->second.sameSettings(registration)) {
+            updated.push_back(std::make_pair(correlation, registration));
+        }
+    }
+
+    for (std::map<int, Registration>::const_iterator it = registry.begin();
+         it != registry.end(); ++it) {
+        if (seen.count(it->first))
+            continue;
+        unsubscribeList.add(it->second.security.c_str(),
+                            blpapi::CorrelationId(it->first,
+                                                  it->second.classId));
+        removed.push_back(it->first);
+    }
+
+    Handle<Value> label = args.Length() == 2 ? args[1] : Handle<Value>();
+
+    // Changes of decoding settings alone need nothing sent.
+    session->updateSubscriptions(updated);
+
+    // The registry follows each step as it is sent, so that a step which
+    // throws leaves it describing what was actually requested.
+    BLPAPI_EXCEPTION_TRY
+    if (unsubscribeList.size() > 0 && !session->d_offline)
+        session->d_session->unsubscribe(unsubscribeList);
+    session->removeSubscriptions(removed);
+    if (resubscribeList.size() > 0)
+        session->sendSubscriptions(resubscribeList, resubscribed, label,
+                                   true);
+    if (subscribeList.size() > 0)
+        session->sendSubscriptions(subscribeList, subscribed, label, false);
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    Local<Object> result = Object::New();
+    result->Set(String::New("subscribed"),
+                Integer::New(subscribeList.size()));
+    result->Set(String::New("resubscribed"),
+                Integer::New(resubscribeList.size()));
+    result->Set(String::New("unsubscribed"),
+                Integer::New(unsubscribeList.size()));
+    return scope.Close(result);
+}
+
+Handle<Value>
+Session::Snapshot(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 ||
+        !(args[0]->IsArray() ||
+          (args[0]->IsObject() &&
+           args[0]->ToObject()->HasIndexedPropertiesInExternalArrayData() &&
+           args[0]->ToObject()->GetIndexedPropertiesExternalArrayDataType()
+               == kExternalIntArray))) {
+        return ThrowException(Exception::Error(String::New(
+                "Array or Int32Array of correlation identifiers must be "
+                "provided as first parameter.")));
+    }
+    if (args.Length() < 2 || !args[1]->IsArray()) {
+        return ThrowException(Exception::Error(String::New(
+                "Array of field names must be provided as second "
+                "parameter.")));
+    }
+    if (args.Length() > 2) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most two arguments.")));
+    }
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    std::vector<int> correlations;
+    Local<Object> cido = args[0]->ToObject();
+    if (args[0]->IsArray()) {
+        uint32_t length = Array::Cast(*args[0])->Length();
+        correlations.reserve(length);
+        for (uint32_t i = 0; i < length; ++i) {
+            Local<Value> v = cido->Get(i);
+            if (!v->IsInt32()) {
+                return ThrowException(Exception::Error(String::New(
+                            "Correlation identifiers must be integers.")));
+            }
+            correlations.push_back(v->Int32Value());
+        }
+    } else {
+        const int32_t *cidv = static_cast<const int32_t*>(
+                cido->GetIndexedPropertiesExternalArrayData());
+        correlations.assign(cidv, cidv +
+                cido->GetIndexedPropertiesExternalArrayDataLength());
+    }
+
+    // Fields never seen by BLPAPI can not be cached; they read as NaN.
+    Local<Object> fieldso = args[1]->ToObject();
+    uint32_t numFields = Array::Cast(*args[1])->Length();
+    std::vector<blpapi_Name_t*> names(numFields);
+    std::vector<double*> columns(numFields);
+
+    Local<Object> result = Object::New();
+    Handle<Value> argv[1] = {
+        Integer::NewFromUnsigned(correlations.size())
+    };
+    for (uint32_t i = 0; i < numFields; ++i) {
+        Local<Value> field = fieldso->Get(i);
+        if (!field->IsString()) {
+            return ThrowException(Exception::Error(String::New(
+                        "Field names must be strings.")));
+        }
+        String::Utf8Value fieldv(field);
+        names[i] = blpapi::Name::hasName(*fieldv)
+                 ? blpapi::Name(*fieldv).impl() : 0;
+
+        Local<Object> column = s_float64_array->NewInstance(1, argv);
+        columns[i] = static_cast<double*>(
+                column->GetIndexedPropertiesExternalArrayData());
+        result->Set(field, column);
+    }
+
+    session->d_cache.snapshot(correlations, names, columns);
+
+    return scope.Close(result);
+}
+
+static inline void
+mkdatetime(blpapi::Datetime* dt, Local<Value> val)
+{
+    double ms = Date::Cast(*val)->NumberValue();
+    time_t sec = static_cast<time_t>(ms / 1000.0);
+    int remainder = static_cast<int>(fmod(ms, 1000.0));
+
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+
+    dt->setDate(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    dt->setTime(tm.tm_hour, tm.tm_min, tm.tm_sec, remainder);
+}
+
+Handle<Value>
+Session::Request(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "Service URI string must be provided as first parameter.")));
+    }
+    if (args.Length() < 2 || !args[1]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "String request name must be provided as second parameter.")));
+    }
+    if (args.Length() < 3 || !args[2]->IsObject()) {
+        return ThrowException(Exception::Error(String::New(
+                "Object containing request parameters must be provided "
+                "as third parameter.")));
+    }
+    if (args.Length() < 4 || !args[3]->IsInt32()) {
+        return ThrowException(Exception::Error(String::New(
+                "Integer correlation identifier must be provided "
+                "as fourth parameter.")));
+    }
+    if (args.Length() >= 5 && !args[4]->IsUndefined() &&
+        !args[4]->IsNull() && !args[4]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "Optional request label must be a string.")));
+    }
+    if (args.Length() >= 6 && !args[5]->IsUndefined() &&
+        !args[5]->IsObject()) {
+        return ThrowException(Exception::Error(String::New(
+                "Optional request options must be an object.")));
+    }
+    if (args.Length() > 6) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most six arguments.")));
+    }
+
+    int cidi = args[3]->Int32Value();
+
+    // Process the 'columnar' option
+    bool columnar = false;
+    if (args.Length() == 6 && args[5]->IsObject()) {
+        Local<Value> c = args[5]->ToObject()->Get(String::New("columnar"));
+        if (!c->IsUndefined() && !c->IsBoolean()) {
+            return ThrowException(Exception::Error(String::New(
+                    "Option 'columnar' must be a boolean.")));
+        }
+        columnar = c->BooleanValue();
+    }
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    // Offline sessions never open the services whose schemas build
+    // requests; a recording holds its own responses.
+    if (session->d_offline)
+        return scope.Close(Integer::New(cidi));
+
+    BLPAPI_EXCEPTION_TRY
+
+    Local<String> uri = args[0]->ToString();
+    std::vector<char> uriv;
+    uriv.reserve(uri->Length() + 1);
+    uri->WriteAscii(&uriv[0]);
+
+    blpapi::Service service = session->d_session->getService(&uriv[0]);
+
+    Local<String> name = args[1]->ToString();
+    std::vector<char> namev;
+    namev.reserve(name->Utf8Length() + 1);
+    name->WriteUtf8(&namev[0]);
+
+    blpapi::Request request = service.createRequest(&namev[0]);
+
+    // Loop over object properties, appending/setting into the request.
+    Local<Object> obj = args[2]->ToObject();
+    Local<Array> props = obj->GetPropertyNames();
+
+    for (int i = 0; i < props->Length(); ++i) {
+        // Process the key.
+        Local<Value> keyval = props->Get(i);
+        Local<String> key = keyval->ToString();
+        std::vector<char> keyv;
+        keyv.reserve(key->Utf8Length() + 1);
+        key->WriteUtf8(&keyv[0]);
+
+        // Process the value.
+        //
+        // The values present on the outer object are marshalled into the
+        // blpapi::Request by setting values using 'set'.  Arrays indicate
+        // values which should be marshalled using 'append'.
+        Local<Value> val = obj->Get(keyval);
+        if (val->IsString()) {
+            Local<String> s = val->ToString();
+            std::vector<char> valv;
+            valv.reserve(s->Utf8Length() + 1);
+            s->WriteUtf8(&valv[0]);
+            request.set(&keyv[0], &valv[0]);
+        } else if (val->IsBoolean()) {
+            request.set(&keyv[0], val->BooleanValue());
+        } else if (val->IsNumber()) {
+            request.set(&keyv[0], val->NumberValue());
+        } else if (val->IsInt32()) {
+            request.set(&keyv[0], val->Int32Value());
+        } else if (val->IsUint32()) {
+            request.set(&keyv[0],
+                static_cast<blpapi::Int64>(val->Uint32Value()));
+        } else if (val->IsDate()) {
+            blpapi::Datetime dt;
+            mkdatetime(&dt, val);
+            request.set(&keyv[0], dt);
+        } else if (val->IsArray()) {
+            // Arrays are marshalled into the blpapi::Request by appending
+            // value types using the key of the array in the outer object.
+            Local<Object> subarray = val->ToObject();
+            int jmax = Array::Cast(*val)->Length();
+            for (int j = 0; j < jmax; ++j) {
+                Local<Value> subval = subarray->Get(j);
+                // Only strings, booleans, and numbers are marshalled.
+                if (subval->IsString()) {
+                    Local<String> s = subval->ToString();
+                    std::vector<char> subvalv;
+                    subvalv.reserve(s->Utf8Length() + 1);
+                    s->WriteUtf8(&subvalv[0]);
+                    request.append(&keyv[0], &subvalv[0]);
+                } else if (subval->IsBoolean()) {
+                    request.append(&keyv[0], subval->BooleanValue());
+                } else if (subval->IsNumber()) {
+                    request.append(&keyv[0], subval->NumberValue());
+                } else if (subval->IsInt32()) {
+                    request.append(&keyv[0], subval->Int32Value());
+                } else if (subval->IsUint32()) {
+                    request.append(&keyv[0],
+                        static_cast<blpapi::Int64>(subval->Uint32Value()));
+                } else if (subval->IsDate()) {
+                    blpapi::Datetime dt;
+                    mkdatetime(&dt, subval);
+                    request.append(&keyv[0], dt);
+                } else {
+                    return ThrowException(Exception::Error(String::New(
+                                "Array contains invalid value type.")));
+                }
+            }
+        } else {
+            return ThrowException(Exception::Error(String::New(
+                        "Object contains invalid value type.")));
+        }
+    }
+
+    blpapi::CorrelationId cid(cidi);
+
+    if (args.Length() >= 5 && args[4]->IsString()) {
+        std::vector<char> labelv;
+        Local<String> s = args[4]->ToString();
+        labelv.reserve(s->Utf8Length() + 1);
+        int len = s->WriteUtf8(&labelv[0]);
+        session->d_session->sendRequest(request, cid, 0, &labelv[0], len);
+    } else {
+        session->d_session->sendRequest(request, cid);
+    }
+
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    if (columnar)
+        session->d_columnar.insert(cidi);
+
+    return scope.Close(Integer::New(cidi));
+}
+
+Handle<Value>
+Session::PrepareRequest(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "Service URI string must be provided as first parameter.")));
+    }
+    if (args.Length() < 2 || !args[1]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "String request name must be provided as second parameter.")));
+    }
+    if (args.Length() < 3 || !args[2]->IsObject()) {
+        return ThrowException(Exception::Error(String::New(
+                "Object containing the request shape must be provided "
+                "as third parameter.")));
+    }
+    if (args.Length() > 3) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most three arguments.")));
+    }
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    if (session->d_offline) {
+        return ThrowException(Exception::Error(String::New(
+                "Requests can not be prepared by offline sessions.")));
+    }
+
+    Local<Object> o = s_prepared_request->GetFunction()->NewInstance();
+
+    BLPAPI_EXCEPTION_TRY
+
+    String::Utf8Value uri(args[0]);
+    blpapi::Service service = session->d_session->getService(*uri);
+
+    String::Utf8Value name(args[1]);
+    const blpapi::SchemaTypeDefinition& type =
+        service.getOperation(*name).requestDefinition().typeDefinition();
+
+    PreparedRequest *prepared = new PreparedRequest(session, service, *name);
+    prepared->wrap(o);
+
+    // Resolve every property of the shape against the request schema.
+    Local<Object> shape = args[2]->ToObject();
+    Local<Array> props = shape->GetPropertyNames();
+
+    for (uint32_t i = 0; i < props->Length(); ++i) {
+        Local<String> key = props->Get(i)->ToString();
+        String::Utf8Value keyv(key);
+        if (!type.hasElementDefinition(*keyv)) {
+            return ThrowException(Exception::Error(String::Concat(
+                        String::New("Request has no element named "),
+                        key)));
+        }
+        if (!prepared->addField(key, shape->Get(key),
+                                type.getElementDefinition(*keyv))) {
+            return ThrowException(Exception::Error(String::Concat(
+                        String::New("Request element type is not "
+                                    "supported: "), key)));
+        }
+    }
+
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    return scope.Close(o);
+}
+
+Session::PreparedRequest::PreparedRequest(Session* session,
+                                          const blpapi::Service& service,
+                                          const char* operation)
+    : d_session(session)
+    , d_service(service)
+    , d_operation(operation)
+{
+    // Requests are sent through the session, so it must outlive this.
+    d_session->Ref();
+}
+
+Session::PreparedRequest::~PreparedRequest()
+{
+    for (size_t i = 0; i < d_fields.size(); ++i) {
+        d_fields[i].key.Dispose();
+        d_fields[i].defaultValue.Dispose();
+    }
+    d_session->Unref();
+}
+
+bool
+Session::PreparedRequest::addField(Handle<String> key,
+                                   Handle<Value> defaultValue,
+                                   const blpapi::SchemaElementDefinition& def)
+{
+    int datatype = def.typeDefinition().datatype();
+    if (datatype == blpapi::DataType::SEQUENCE ||
+        datatype == blpapi::DataType::CHOICE)
+        return false;
+
+    // Symbols make the per-send property lookups cheap.
+    String::Utf8Value keyv(key);
+    d_fields.push_back(Field());
+    Field& field = d_fields.back();
+    field.key = Persistent<String>::New(String::NewSymbol(*keyv));
+    if (!defaultValue->IsUndefined() && !defaultValue->IsNull())
+        field.defaultValue = Persistent<Value>::New(defaultValue);
+    field.name = def.name();
+    field.datatype = datatype;
+    field.isArray = def.maxValues() != 1;
+    return true;
+}
+
+bool
+Session::PreparedRequest::setValue(blpapi::Request* request,
+                                   const Field& field, Handle<Value> value,
+                                   bool append)
+{
+    // Strings are passed through for BLPAPI to convert to the element
+    // type, as with 'request'; other values must match the schema.
+    if (value->IsString()) {
+        Local<String> s = value->ToString();
+        d_buffer.resize(s->Utf8Length() + 1);
+        s->WriteUtf8(&d_buffer[0]);
+        if (append)
+            request->append(field.name, &d_buffer[0]);
+        else
+            request->set(field.name, &d_buffer[0]);
+        return true;
+    }
+
+    switch (field.datatype) {
+    case blpapi::DataType::BOOL:
+        if (!value->IsBoolean())
+            return false;
+        if (append)
+            request->append(field.name, value->BooleanValue());
+        else
+            request->set(field.name, value->BooleanValue());
+        return true;
+    case blpapi::DataType::CHAR:
+    case blpapi::DataType::BYTE:
+    case blpapi::DataType::INT32:
+    case blpapi::DataType::INT64:
+        if (!value->IsNumber())
+            return false;
+        if (append)
+            request->append(field.name,
+                    static_cast<blpapi::Int64>(value->IntegerValue()));
+        else
+            request->set(field.name,
+                    static_cast<blpapi::Int64>(value->IntegerValue()));
+        return true;
+    case blpapi::DataType::FLOAT32:
+    case blpapi::DataType::FLOAT64:
+    case blpapi::DataType::DECIMAL:
+        if (!value->IsNumber())
+            return false;
+        if (append)
+            request->append(field.name, value->NumberValue());
+        else
+            request->set(field.name, value->NumberValue());
+        return true;
+    case blpapi::DataType::DATE:
+    case blpapi::DataType::TIME:
+    case blpapi::DataType::DATETIME: {
+        if (!value->IsDate())
+            return false;
+        blpapi::Datetime dt;
+        mkdatetime(&dt, Local<Value>::New(value));
+        if (append)
+            request->append(field.name, dt);
+        else
+            request->set(field.name, dt);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+Handle<Value>
+Session::PreparedRequest::Send(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsObject()) {
+        return ThrowException(Exception::Error(String::New(
+                "Object containing request values must be provided "
+                "as first parameter.")));
+    }
+    if (args.Length() < 2 || !args[1]->IsInt32()) {
+        return ThrowException(Exception::Error(String::New(
+                "Integer correlation identifier must be provided "
+                "as second parameter.")));
+    }
+    if (args.Length() >= 3 && !args[2]->IsUndefined() &&
+        !args[2]->IsNull() && !args[2]->IsString()) {
+        return ThrowException(Exception::Error(String::New(
+                "Optional request label must be a string.")));
+    }
+    if (args.Length() > 3) {
+        return ThrowException(Exception::Error(String::New(
+                "Function expects at most three arguments.")));
+    }
+
+    PreparedRequest* prepared =
+        ObjectWrap::Unwrap<PreparedRequest>(args.This());
+    int cidi = args[1]->Int32Value();
+
+    BLPAPI_EXCEPTION_TRY
+
+    blpapi::Request request =
+        prepared->d_service.createRequest(prepared->d_operation.c_str());
+
+    // Reject values the prepared shape does not know about, as the
+    // unprepared request path does.
+    Local<Object> values = args[0]->ToObject();
+    Local<Array> props = values->GetPropertyNames();
+    for (uint32_t i = 0; i < props->Length(); ++i) {
+        Local<Value> key = props->Get(i);
+        size_t j = 0;
+        while (j < prepared->d_fields.size() &&
+               !prepared->d_fields[j].key->StrictEquals(key))
+            ++j;
+        if (j == prepared->d_fields.size()) {
+            return ThrowException(Exception::Error(String::Concat(
+                        String::New("Request has no element named "),
+                        key->ToString())));
+        }
+    }
+
+    for (size_t i = 0; i < prepared->d_fields.size(); ++i) {
+        const Field& field = prepared->d_fields[i];
+        Local<Value> val = values->Get(field.key);
+        if (val->IsUndefined()) {
+            if (field.defaultValue.IsEmpty())
+                continue;
+            val = Local<Value>::New(field.defaultValue);
+        }
+
+        bool valid = true;
+        if (field.isArray && val->IsArray()) {
+            Local<Object> subarray = val->ToObject();
+            uint32_t jmax = Array::Cast(*val)->Length();
+            for (uint32_t j = 0; valid && j < jmax; ++j)
+                valid = prepared->setValue(&request, field,
+                                           subarray->Get(j), true);
+        } else if (!field.isArray) {
+            valid = prepared->setValue(&request, field, val, false);
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            return ThrowException(Exception::Error(String::Concat(
+                        String::New("Invalid value type for element "),
+                        Local<String>::New(field.key))));
+        }
+    }
+
+    blpapi::CorrelationId cid(cidi);
+
+    if (args.Length() >= 3 && args[2]->IsString()) {
+        String::Utf8Value label(args[2]);
+        prepared->d_session->d_session->sendRequest(request, cid, 0,
+                                                    *label, label.length());
+    } else {
+        prepared->d_session->d_session->sendRequest(request, cid);
+    }
+
+    BLPAPI_EXCEPTION_CATCH_RETURN
+
+    return scope.Close(Integer::New(cidi));
+}
+
+Handle<Value>
+Session::Stats(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() > 1 ||
+        (args.Length() > 0 && !args[0]->IsUndefined() &&
+         !args[0]->IsBoolean())) {
+        return ThrowException(Exception::Error(String::New(
+                "Optional reset flag must be a boolean.")));
+    }
+    bool reset = args.Length() > 0 && args[0]->BooleanValue();
+
+    Session* session = ObjectWrap::Unwrap<Session>(args.This());
+
+    Local<Object> queue = Object::New();
+    queue->Set(String::New("capacity"),
+               Number::New(session->d_que.capacity()));
+    queue->Set(String::New("enqueued"),
+               Number::New(session->d_que.enqueued()));
+    queue->Set(String::New("dequeued"),
+               Number::New(session->d_que.dequeued()));
+    queue->Set(String::New("fullWaits"),
+               Number::New(session->d_full_waits));
+    queue->Set(String::New("depth"),
+               Number::New(session->d_que.depth()));
+    queue->Set(String::New("peakDepth"),
+               Number::New(session->d_peak_depth));
+    queue->Set(String::New("blockedWaits"),
+               Number::New(session->d_blocked_waits));
+    queue->Set(String::New("dropped"),
+               Number::New(session->d_dropped));
+    queue->Set(String::New("yields"),
+               Number::New(session->d_yields));
+    queue->Set(String::New("slow"),
+               Boolean::New(session->d_slow_notified));
+
+    Local<Object> conflation = Object::New();
+    conflation->Set(String::New("merged"),
+                    Number::New(session->d_conflator.merged()));
+    conflation->Set(String::New("delivered"),
+                    Number::New(session->d_conflator.delivered()));
+
+    Local<Object> o = Object::New();
+    o->Set(String::New("queue"), queue);
+    o->Set(String::New("conflation"), conflation);
+
+    size_t rows, fields;
+    session->d_cache.size(&rows, &fields);
+    Local<Object> cache = Object::New();
+    cache->Set(String::New("correlations"), Number::New(rows));
+    cache->Set(String::New("fields"), Number::New(fields));
+    cache->Set(String::New("updates"),
+               Number::New(session->d_cache.updates()));
+    o->Set(String::New("cache"), cache);
+
+    Local<Object> bars = Object::New();
+    bars->Set(String::New("completed"),
+              Number::New(session->d_bars.completed()));
+    o->Set(String::New("bars"), bars);
+
+    Local<Object> lazy = Object::New();
+    lazy->Set(String::New("pinned"),
+              Number::New(session->d_lazy_pinned));
+    lazy->Set(String::New("eager"),
+              Number::New(session->d_lazy_eager));
+    o->Set(String::New("lazy"), lazy);
+
+    Local<Object> strings = Object::New();
+    strings->Set(String::New("names"),
+                 Number::New(session->d_names.size()));
+    strings->Set(String::New("topics"),
+                 Number::New(session->d_topics.size()));
+    strings->Set(String::New("interned"),
+                 Number::New(session->d_interned));
+    o->Set(String::New("strings"), strings);
+    if (session->d_latency)
+        o->Set(String::New("latency"), session->latencyToValue());
+
+    // Resetting restarts the peak depth and latency measurements; the
+    // other counters are cumulative.
+    if (reset) {
+        session->d_peak_depth = session->d_que.depth();
+        session->resetLatency();
+    }
+
+    return scope.Close(o);
+}
+
+Handle<Value>
+Session::DecodeWire(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1 || !args[0]->IsObject() ||
+        !args[0]->ToObject()->HasIndexedPropertiesInExternalArrayData() ||
+        (args[0]->ToObject()->GetIndexedPropertiesExternalArrayDataType()
+            != kExternalUnsignedByteArray &&
+         args[0]->ToObject()->GetIndexedPropertiesExternalArrayDataType()
+            != kExternalByteArray)) {
+        return ThrowException(Exception::Error(String::New(
+                "ArrayBuffer, byte array or Buffer must be provided as "
+                "the only parameter.")));
+    }
+
+    Local<Object> chunk = args[0]->ToObject();
+    EventBuffer::Cursor cursor(
+            static_cast<const char*>(
+                chunk->GetIndexedPropertiesExternalArrayData()),
+            chunk->GetIndexedPropertiesExternalArrayDataLength());
+
+    Local<Array> messages = Array::New();
+    if (!wireToMessages(&cursor, messages))
+        return ThrowException(Exception::Error(String::New(
+                "Wire chunk is malformed.")));
+
+    return scope.Close(messages);
+}
+
+bool
+Session::wireToMessages(EventBuffer::Cursor* cursor, Handle<Array> messages)
+{
+    // Use the HandleScope of the calling function for speed.
+    //
+    // Mirrors 'bufferToMessage', for a chunk of the wire encoding from
+    // outside the process.
+
+    char magic[sizeof(WireEncoder::MAGIC)];
+    uint32_t version, numNames, numMessages;
+    if (!cursor->read(&magic) || !cursor->read(&version) ||
+        !cursor->read(&numNames) || !cursor->read(&numMessages) ||
+        0 != memcmp(magic, WireEncoder::MAGIC, sizeof(magic)) ||
+        version != WireEncoder::VERSION)
+        return false;
+
+    std::vector<Local<String> > names;
+    for (uint32_t i = 0; i < numNames; ++i) {
+        const char *str;
+        uint32_t length;
+        if (!cursor->readString(&str, &length))
+            return false;
+        names.push_back(String::NewSymbol(str, length));
+    }
+
+    for (uint32_t i = 0; i < numMessages; ++i) {
+        int32_t eventType;
+        uint32_t messageType;
+        const char *topic;
+        uint32_t topicLength;
+        uint32_t numCorrelationIds;
+        if (!cursor->read(&eventType) || !cursor->read(&messageType) ||
+            messageType >= names.size() ||
+            !cursor->readString(&topic, &topicLength) ||
+            !cursor->read(&numCorrelationIds))
+            return false;
+
+        Local<Array> correlations = Array::New();
+        for (uint32_t j = 0; j < numCorrelationIds; ++j) {
+            uint8_t valueType;
+            int64_t value;
+            int32_t classId;
+            if (!cursor->read(&valueType) || !cursor->read(&value) ||
+                !cursor->read(&classId))
+                return false;
+            if (valueType == blpapi::CorrelationId::INT_VALUE ||
+                valueType == blpapi::CorrelationId::AUTOGEN_VALUE) {
+                correlations->Set(j, correlationToValue(value, classId));
+            } else {
+                correlations->Set(j, Object::New());
+            }
+        }
+
+        Handle<Value> data = wireToValue(cursor, names, 0);
+        if (data.IsEmpty())
+            return false;
+
+        Local<Object> o = newMessage(
+                static_cast<blpapi::Event::EventType>(eventType),
+                names[messageType], String::New(topic, topicLength),
+                correlations);
+        o->Set(s_data, data);
+        messages->Set(i, o);
+    }
+
+    return cursor->atEnd();
+}
+
+Handle<Value>
+Session::wireToValue(EventBuffer::Cursor* cursor,
+                     const std::vector<Local<String> >& names, int depth)
+{
+    // Use the HandleScope of the calling function for speed.
+    //
+    // Mirrors 'bufferToValue', returning an empty handle if malformed.
+
+    static const int MAX_DEPTH = 64;
+    uint8_t tag;
+    if (depth > MAX_DEPTH || !cursor->read(&tag))
+        return Handle<Value>();
+
+    switch (tag) {
+        case EventBuffer::TAG_NULL:
+            return Null();
+        case EventBuffer::TAG_TRUE:
+            return True();
+        case EventBuffer::TAG_FALSE:
+            return False();
+        case EventBuffer::TAG_CHAR: {
+            char c;
+            if (!cursor->read(&c))
+                break;
+            return String::New(&c, 1);
+        }
+        case EventBuffer::TAG_INT32: {
+            int32_t i;
+            if (!cursor->read(&i))
+                break;
+            return Integer::New(i);
+        }
+        case EventBuffer::TAG_NUMBER: {
+            double d;
+            if (!cursor->read(&d))
+                break;
+            return Number::New(d);
+        }
+        case EventBuffer::TAG_STRING: {
+            const char *str;
+            uint32_t length;
+            if (!cursor->readString(&str, &length))
+                break;
+            return String::New(str, length);
+        }
+        case EventBuffer::TAG_NAME: {
+            uint32_t name;
+            if (!cursor->read(&name) || name >= names.size())
+                break;
+            return names[name];
+        }
+        case EventBuffer::TAG_DATE: {
+            double ms;
+            if (!cursor->read(&ms))
+                break;
+            return Date::New(ms);
+        }
+        case EventBuffer::TAG_OBJECT: {
+            uint32_t count;
+            if (!cursor->read(&count))
+                break;
+            Local<Object> o = Object::New();
+            for (uint32_t i = 0; i < count; ++i) {
+                uint32_t name;
+                if (!cursor->read(&name) || name >= names.size())
+                    return Handle<Value>();
+                Handle<Value> value = wireToValue(cursor, names, depth + 1);
+                if (value.IsEmpty())
+                    return Handle<Value>();
+                o->Set(names[name], value,
+                       (PropertyAttribute)(ReadOnly | DontDelete));
+            }
+            return o;
+        }
+        case EventBuffer::TAG_ARRAY: {
+            uint32_t count;
+            if (!cursor->read(&count))
+                break;
+            Local<Array> a = Array::New();
+            for (uint32_t i = 0; i < count; ++i) {
+                Handle<Value> value = wireToValue(cursor, names, depth + 1);
+                if (value.IsEmpty())
+                    return Handle<Value>();
+                a->Set(i, value);
+            }
+            return a;
+        }
+        default:
+            break;
+    }
+
+    return Handle<Value>();
+}
+
+Handle<Value>
+Session::elementToValue(const blpapi::Element& e)
+{
+    if (e.isComplexType()) {
+        int numElements = e.numElements();
+        Local<Object> o = Object::New();
+        for (int i = 0; i < numElements; ++i) {
+            blpapi::Element se = e.getElement(i);
+            Handle<Value> sev;
+            if (se.isComplexType() || se.isArray()) {
+                sev = elementToValue(se);
+            } else {
+                sev = elementValueToValue(se);
+            }
+            o->Set(nameToString(se.name()),
+                   sev, (PropertyAttribute)(ReadOnly | DontDelete));
+        }
+        return o;
+    } else if (e.isArray()) {
+        if (d_decode_columnar &&
+            e.datatype() == blpapi::DataType::SEQUENCE &&
+            e.numValues() > 0) {
+            return elementToColumns(e);
+        }
+        int numValues = e.numValues();
+        Local<Object> o = Array::New(numValues);
+        for (int i = 0; i < numValues; ++i) {
+            o->Set(i, elementValueToValue(e, i));
+        }
+        return o;
+    } else {
+        return elementValueToValue(e);
+    }
+}
+
+// Return the milliseconds since the epoch of the current time.
+static inline double
+mknowms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// External string whose bytes are owned by a BLPAPI event, which is
+// referenced until V8 collects the string.  The size of the string is
+// reported to V8 as external memory so that collection keeps pace.  The
+// destructor runs within garbage collection, where V8 must not be called
+// back, so released sizes are only reported by the next 'settle'.
+class EventStringResource : public String::ExternalAsciiStringResource
+{
+  public:
+    EventStringResource(const blpapi::Event& ev, const char* str,
+                        size_t length)
+        : d_event(ev), d_str(str), d_len(length) {
+        V8::AdjustAmountOfExternalAllocatedMemory(d_len);
+    }
+    ~EventStringResource() { s_released += d_len; }
+
+    static void settle() {
+        if (s_released) {
+            V8::AdjustAmountOfExternalAllocatedMemory(
+                    -static_cast<intptr_t>(s_released));
+            s_released = 0;
+        }
+    }
+
+    const char* data() const { return d_str; }
+    size_t length() const { return d_len; }
+
+  private:
+    EventStringResource(const EventStringResource&);
+    EventStringResource& operator=(const EventStringResource&);
+
+    blpapi::Event d_event;
+    const char* d_str;
+    size_t d_len;
+
+    static size_t s_released;
+};
+
+size_t EventStringResource::s_released = 0;
+
+static inline bool
+isasciistring(const char* str, size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        if (str[i] & 0x80)
+            return false;
+    }
+    return true;
+}
+
+Handle<String>
+Session::stringToValue(const char* str)
+{
+    // Use the HandleScope of the calling function for speed.
+    //
+    // Long ASCII strings of the event being decoded are wrapped rather
+    // than copied.  Others, and strings decoded outside of an event, are
+    // copied as usual.
+    size_t length = strlen(str);
+    if (d_external_strings && d_decode_event &&
+        length >= d_external_strings && isasciistring(str, length)) {
+        return String::NewExternal(
+                new EventStringResource(*d_decode_event, str, length));
+    }
+    return String::New(str, length);
+}
+
+Handle<Value>
+Session::elementValueToValue(const blpapi::Element& e, int idx)
+{
+    if (e.isNull())
+        return Null();
+
+    switch (e.datatype()) {
+        case blpapi::DataType::BOOL:
+            return Boolean::New(e.getValueAsBool(idx));
+        case blpapi::DataType::CHAR: {
+            char c = e.getValueAsChar(idx);
+            return String::New(&c, 1);
+        }
+        case blpapi::DataType::BYTE:
+        case blpapi::DataType::INT32:
+            return Integer::New(e.getValueAsInt32(idx));
+        case blpapi::DataType::FLOAT32:
+            return Number::New(e.getValueAsFloat32(idx));
+        case blpapi::DataType::FLOAT64:
+            return Number::New(e.getValueAsFloat64(idx));
+        case blpapi::DataType::ENUMERATION:
+            return nameToString(e.getValueAsName(idx));
+        case blpapi::DataType::INT64: {
+            // IEEE754 double can represent the range [-2^53, 2^53].
+            static const blpapi::Int64 MAX_DOUBLE_INT = 9007199254740992LL;
+            blpapi::Int64 i = e.getValueAsInt64(idx);
+            if ((i >= -MAX_DOUBLE_INT) && (i <= MAX_DOUBLE_INT))
+                return Number::New(static_cast<double>(i));
+            break;
+        }
+        case blpapi::DataType::STRING:
+            return stringToValue(e.getValueAsString(idx));
+        case blpapi::DataType::DATE:
+        case blpapi::DataType::TIME:
+        case blpapi::DataType::DATETIME: {
+            double ms;
+            if (mkepochms(&ms, e.getValueAsDatetime(idx), e.datatype()))
+                return Date::New(ms);
+            break;
+        }
+        case blpapi::DataType::SEQUENCE:
+            return elementToValue(e.getValueAsElement(idx));
+        default:
+            break;
+    }
+
+    return Null();
+}
+
+static inline bool
+isnumerictype(int datatype)
+{
+    switch (datatype) {
+        case blpapi::DataType::BYTE:
+        case blpapi::DataType::INT32:
+        case blpapi::DataType::INT64:
+        case blpapi::DataType::FLOAT32:
+        case blpapi::DataType::FLOAT64:
+        case blpapi::DataType::DATE:
+        case blpapi::DataType::TIME:
+        case blpapi::DataType::DATETIME:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Load into 'value' the number held by the scalar element 'e', with dates
+// and times converted to milliseconds since the epoch.  Return false if
+// 'e' is null or not of a numeric type.
+static inline bool
+mknumber(double* value, const blpapi::Element& e)
+{
+    if (e.isNull())
+        return false;
+
+    switch (e.datatype()) {
+        case blpapi::DataType::BYTE:
+        case blpapi::DataType::INT32:
+            *value = e.getValueAsInt32();
+            return true;
+        case blpapi::DataType::INT64:
+            *value = static_cast<double>(e.getValueAsInt64());
+            return true;
+        case blpapi::DataType::FLOAT32:
+            *value = e.getValueAsFloat32();
+            return true;
+        case blpapi::DataType::FLOAT64:
+            *value = e.getValueAsFloat64();
+            return true;
+        case blpapi::DataType::DATE:
+        case blpapi::DataType::TIME:
+        case blpapi::DataType::DATETIME:
+            return mkepochms(value, e.getValueAsDatetime(), e.datatype());
+        default:
+            return false;
+    }
+}
+
+void
+LastValueCache::update(const blpapi::Message& msg,
+                       const Subscription& subscription)
+{
+    // Decode outside the lock; only the stores are serialized.
+    std::vector<std::pair<blpapi_Name_t*, double> > values;
+    blpapi::Element e = msg.asElement();
+    if (subscription.projection.empty()) {
+        const size_t numElements = e.numElements();
+        values.reserve(numElements);
+        for (size_t i = 0; i < numElements; ++i) {
+            blpapi::Element se = e.getElement(i);
+            double value;
+            if (!se.isArray() && !se.isComplexType() && mknumber(&value, se))
+                values.push_back(std::make_pair(se.name().impl(), value));
+        }
+    } else {
+        values.reserve(subscription.projection.size());
+        for (size_t i = 0; i < subscription.projection.size(); ++i) {
+            blpapi::Element se;
+            double value;
+            if (0 == e.getElement(&se, subscription.projection[i]) &&
+                !se.isArray() && !se.isComplexType() && mknumber(&value, se))
+                values.push_back(std::make_pair(se.name().impl(), value));
+        }
+    }
+    update(static_cast<int>(msg.correlationId(0).asInteger()), values);
+}
+
+void
+LastValueCache::update(
+        int correlation,
+        const std::vector<std::pair<blpapi_Name_t*, double> >& values)
+{
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+
+    pthread_mutex_lock(&d_mutex);
+
+    uint32_t row;
+    std::map<int, uint32_t>::iterator rit = d_rows.find(correlation);
+    if (rit != d_rows.end()) {
+        row = rit->second;
+    } else if (!d_free_rows.empty()) {
+        row = d_free_rows.back();
+        d_free_rows.pop_back();
+        d_rows[correlation] = row;
+    } else {
+        row = d_rows.size();
+        d_rows[correlation] = row;
+    }
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        std::map<blpapi_Name_t*, uint32_t>::iterator fit =
+            d_field_ids.find(values[i].first);
+        uint32_t field;
+        if (fit != d_field_ids.end()) {
+            field = fit->second;
+        } else {
+            field = d_columns.size();
+            d_field_ids[values[i].first] = field;
+            d_columns.push_back(std::vector<double>());
+        }
+        std::vector<double>& column = d_columns[field];
+        if (column.size() <= row)
+            column.resize(row + 1, nan);
+        column[row] = values[i].second;
+    }
+    ++d_updates;
+
+    pthread_mutex_unlock(&d_mutex);
+}
+
+Handle<Value>
+Session::elementToColumns(const blpapi::Element& e)
+{
+    // Use the HandleScope of the calling function for speed.
+    //
+    // Decode an array of sequences into one column per field.  Numeric,
+    // date and time fields become Float64Arrays (NaN where a row lacks
+    // the field); all other fields become arrays of values (null where a
+    // row lacks the field) with repeated strings shared.
+
+    typedef std::map<const char*, Local<String>, CStringLess> StringMap;
+
+    const uint32_t numRows = e.numValues();
+    std::vector<Column> columns;
+    StringMap strings;
+
+    for (uint32_t r = 0; r < numRows; ++r) {
+        blpapi::Element row = e.getValueAsElement(r);
+        const size_t numFields = row.numElements();
+        for (size_t j = 0; j < numFields; ++j) {
+            blpapi::Element fe = row.getElement(j);
+            blpapi::Name name = fe.name();
+
+            // Rows usually repeat the same field order, so try the column
+            // at the same position before searching.
+            size_t c = j;
+            if (c >= columns.size() || columns[c].name != name) {
+                for (c = 0; c < columns.size(); ++c) {
+                    if (columns[c].name == name)
+                        break;
+                }
+            }
+            if (c == columns.size()) {
+                Column column;
+                column.name = name;
+                column.data = 0;
+                if (!fe.isArray() && !fe.isComplexType() &&
+                    isnumerictype(fe.datatype())) {
+                    Handle<Value> argv[1] = {
+                        Integer::NewFromUnsigned(numRows)
+                    };
+                    column.values = s_float64_array->NewInstance(1, argv);
+                    column.data = static_cast<double*>(
+                        column.values->GetIndexedPropertiesExternalArrayData());
+                    std::fill(column.data, column.data + numRows,
+                              std::numeric_limits<double>::quiet_NaN());
+                } else {
+                    column.values = Array::New(numRows);
+                    for (uint32_t k = 0; k < numRows; ++k)
+                        column.values->Set(k, Null());
+                }
+                columns.push_back(column);
+            }
+
+            Column& column = columns[c];
+            if (column.data) {
+                double value;
+                if (!fe.isArray() && mknumber(&value, fe))
+                    column.data[r] = value;
+            } else if (fe.isComplexType() || fe.isArray()) {
+                column.values->Set(r, elementToValue(fe));
+            } else if (!fe.isNull() &&
+                       fe.datatype() == blpapi::DataType::STRING) {
+                const char *str = fe.getValueAsString();
+                StringMap::iterator it = strings.find(str);
+                if (it == strings.end())
+                    it = strings.insert(
+                            std::make_pair(str, String::New(str))).first;
+                column.values->Set(r, it->second);
+            } else {
+                column.values->Set(r, elementValueToValue(fe));
+            }
+        }
+    }
+
+    Local<Object> o = Object::New();
+    for (size_t c = 0; c < columns.size(); ++c) {
+        o->Set(nameToString(columns[c].name), columns[c].values,
+               (PropertyAttribute)(ReadOnly | DontDelete));
+    }
+    return o;
+}
+
+Handle<Value>
+Session::projectionToValue(const blpapi::Element& e,
+                           const std::vector<blpapi::Name>& projection)
+{
+    // Use the HandleScope of the calling function for speed.
+    //
+    // Decode only the projected sub-elements of 'e' which are present.
+
+    Local<Object> o = Object::New();
+    for (size_t i = 0; i < projection.size(); ++i) {
+        blpapi::Element se;
+        if (0 != e.getElement(&se, projection[i]))
+            continue;
+        Handle<Value> sev;
+        if (se.isComplexType() || se.isArray()) {
+            sev = elementToValue(se);
+        } else {
+            sev = elementValueToValue(se);
+        }
+        o->Set(nameToString(se.name()),
+               sev, (PropertyAttribute)(ReadOnly | DontDelete));
+    }
+    return o;
+}
+
+Session::LazyElement::LazyElement(Session* session, const blpapi::Event& ev,
+                                  const blpapi::Element& element)
+    : d_session(session)
+    , d_event(ev)
+    , d_element(element)
+{
+    // The session decodes fields on access, so it must outlive this view.
+    d_session->Ref();
+    ++d_session->d_lazy_pinned;
+}
+
+Session::LazyElement::~LazyElement()
+{
+    d_cache.Dispose();
+    --d_session->d_lazy_pinned;
+    d_session->Unref();
+}
+
+bool
+Session::LazyElement::find(blpapi::Element* element, Local<String> property)
+{
+    // Names never created by BLPAPI can not name a sub-element.
+    String::Utf8Value name(property);
+    if (!blpapi::Name::hasName(*name))
+        return false;
+    blpapi::Name n(*name);
+    if (!d_element.hasElement(n))
+        return false;
+    *element = d_element.getElement(n);
+    return true;
+}
+
+Handle<Value>
+Session::LazyElement::Get(Local<String> property, const AccessorInfo& info)
+{
+    HandleScope scope;
+
+    LazyElement *lazy = ObjectWrap::Unwrap<LazyElement>(info.Holder());
+
+    if (!lazy->d_cache.IsEmpty()) {
+        Local<Value> cached = lazy->d_cache->Get(property);
+        if (!cached->IsUndefined())
+            return scope.Close(cached);
+    }
+
+    BLPAPI_EXCEPTION_TRY
+    blpapi::Element se;
+    if (!lazy->find(&se, property))
+        return Handle<Value>();
+
+    DecodingEvent decoding(lazy->d_session, lazy->d_event);
+    Handle<Value> sev;
+    if (se.isComplexType() || se.isArray()) {
+        sev = lazy->d_session->elementToValue(se);
+    } else {
+        sev = lazy->d_session->elementValueToValue(se);
+    }
+
+    if (lazy->d_cache.IsEmpty())
+        lazy->d_cache = Persistent<Object>::New(Object::New());
+    lazy->d_cache->Set(property, sev);
+    return scope.Close(sev);
+    BLPAPI_EXCEPTION_CATCH_RETURN
+}
+
+Handle<Integer>
+Session::LazyElement::Query(Local<String> property, const AccessorInfo& info)
+{
+    HandleScope scope;
+
+    LazyElement *lazy = ObjectWrap::Unwrap<LazyElement>(info.Holder());
+
+    blpapi::Element se;
+    try {
+        if (!lazy->find(&se, property))
+            return Handle<Integer>();
+    } catch (blpapi::Exception&) {
+        return Handle<Integer>();
+    }
+    return scope.Close(Integer::New(ReadOnly | DontDelete));
+}
+
+Handle<Array>
+Session::LazyElement::Enumerate(const AccessorInfo& info)
+{
+    HandleScope scope;
+
+    LazyElement *lazy = ObjectWrap::Unwrap<LazyElement>(info.Holder());
+
+    int numElements = lazy->d_element.numElements();
+    Local<Array> names = Array::New(numElements);
+    for (int i = 0; i < numElements; ++i) {
+        names->Set(i, lazy->d_session->nameToString(
+                    lazy->d_element.getElement(i).name()));
+    }
+    return scope.Close(names);
+}
+
+Handle<Value>
+Session::lazyElementToValue(const blpapi::Event& ev, const blpapi::Element& e)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    Local<Object> o = s_lazy_template->NewInstance();
+    LazyElement *lazy = new LazyElement(this, ev, e);
+    lazy->wrap(o);
+    return o;
+}
+
+EventBuffer::EventBuffer(const blpapi::Event& ev,
+                         const SubscriptionMap& subscriptions,
+                         const MessageSet& skip, bool portable)
+    : d_portable(portable)
+{
+    d_data.reserve(4096);
+
+    // Reserve the message count and patch it once known.
+    write<uint32_t>(0);
+    uint32_t numMessages = 0;
+
+    blpapi::MessageIterator msgIter(ev);
+    for (uint32_t i = 0; msgIter.next(); ++i) {
+        if (skip.contains(i))
+            continue;
+        const blpapi::Message& msg = msgIter.message();
+        writeMessage(msg, findSubscription(subscriptions, msg));
+        ++numMessages;
+    }
+    memcpy(&d_data[0], &numMessages, sizeof(numMessages));
+}
+
+void
+EventBuffer::writeString(const char* str, size_t length)
+{
+    write<uint32_t>(length);
+    size_t n = d_data.size();
+    d_data.resize(n + length + 1);
+    memcpy(&d_data[n], str, length);
+    d_data[n + length] = '\0';
+}
+
+EventBuffer::EventBuffer(const blpapi::Name& messageType)
+    : d_portable(false)
+{
+    write<uint32_t>(1);
+    writeName(messageType);
+    writeString("", 0);
+    write<uint32_t>(0);
+    write<uint8_t>(TAG_OBJECT);
+    write<uint32_t>(0);
+}
+
+void
+EventBuffer::countMessage()
+{
+    uint32_t numMessages;
+    memcpy(&numMessages, &d_data[0], sizeof(numMessages));
+    ++numMessages;
+    memcpy(&d_data[0], &numMessages, sizeof(numMessages));
+}
+
+void
+EventBuffer::addMessage(const blpapi::Name& messageType, const char* topic,
+                        int correlation, uint32_t numFields)
+{
+    countMessage();
+    writeName(messageType);
+    writeString(topic, strlen(topic));
+    write<uint32_t>(1);
+    write<uint8_t>(blpapi::CorrelationId::INT_VALUE);
+    write<int64_t>(correlation);
+    write<int32_t>(0);
+    write<uint8_t>(TAG_OBJECT);
+    write<uint32_t>(numFields);
+}
+
+void
+EventBuffer::copyMessage(const char* data, size_t length)
+{
+    countMessage();
+    writeBytes(data, length);
+}
+
+void
+EventBuffer::copyMessageHeader(const char* data, size_t length,
+                               uint32_t numFields)
+{
+    countMessage();
+    writeBytes(data, length);
+    write<uint8_t>(TAG_OBJECT);
+    write<uint32_t>(numFields);
+}
+
+void
+EventBuffer::Reader::skipValue()
+{
+    switch (read<uint8_t>()) {
+        case TAG_CHAR:
+            d_pos += sizeof(char);
+            break;
+        case TAG_INT32:
+            d_pos += sizeof(int32_t);
+            break;
+        case TAG_NUMBER:
+        case TAG_DATE:
+            d_pos += sizeof(double);
+            break;
+        case TAG_STRING: {
+            uint32_t length;
+            readString(&length);
+            break;
+        }
+        case TAG_NAME:
+            d_pos += sizeof(blpapi_Name_t*);
+            break;
+        case TAG_OBJECT: {
+            uint32_t count = read<uint32_t>();
+            for (uint32_t i = 0; i < count; ++i) {
+                d_pos += sizeof(blpapi_Name_t*);
+                skipValue();
+            }
+            break;
+        }
+        case TAG_ARRAY: {
+            uint32_t count = read<uint32_t>();
+            for (uint32_t i = 0; i < count; ++i)
+                skipValue();
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+EventBuffer*
+EventBuffer::fromPortable(const char* data, size_t length,
+                          blpapi_Name_t** messageType)
+{
+    EventBuffer *buffer = new EventBuffer;
+    buffer->d_data.reserve(length + 256);
+    *messageType = 0;
+
+    Cursor cursor(data, length);
+    if (!buffer->copyPortableMessages(&cursor, messageType) ||
+        !cursor.atEnd()) {
+        delete buffer;
+        return 0;
+    }
+    return buffer;
+}
+
+bool
+EventBuffer::copyPortableMessages(Cursor* cursor,
+                                  blpapi_Name_t** messageType)
+{
+    // Mirrors the 'EventBuffer' constructor.
+    uint32_t numMessages;
+    if (!cursor->read(&numMessages))
+        return false;
+    memcpy(&d_data[0], &numMessages, sizeof(numMessages));
+    for (uint32_t i = 0; i < numMessages; ++i) {
+        if (!copyName(cursor, 0 == i ? messageType : 0) ||
+            !copyPortableString(cursor))
+            return false;
+
+        uint32_t numCorrelationIds;
+        if (!cursor->read(&numCorrelationIds))
+            return false;
+        write<uint32_t>(numCorrelationIds);
+        for (uint32_t j = 0; j < numCorrelationIds; ++j) {
+            uint8_t valueType;
+            int64_t value;
+            int32_t classId;
+            if (!cursor->read(&valueType) || !cursor->read(&value) ||
+                !cursor->read(&classId))
+                return false;
+            write<uint8_t>(valueType);
+            write<int64_t>(value);
+            write<int32_t>(classId);
+        }
+
+        if (!copyPortableValue(cursor, 0))
+            return false;
+    }
+    return true;
+}
+
+bool
+EventBuffer::copyName(Cursor* cursor, blpapi_Name_t** name)
+{
+    const char *str;
+    uint32_t length;
+    if (!cursor->readString(&str, &length))
+        return false;
+    blpapi_Name_t *impl = blpapi::Name(str).impl();
+    write<blpapi_Name_t*>(impl);
+    if (name)
+        *name = impl;
+    return true;
+}
+
+bool
+EventBuffer::copyPortableString(Cursor* cursor)
+{
+    const char *str;
+    uint32_t length;
+    if (!cursor->readString(&str, &length))
+        return false;
+    writeString(str, length);
+    return true;
+}
+
+bool
+EventBuffer::copyPortableValue(Cursor* cursor, int depth)
+{
+    // Element trees are shallow; bound the recursion on corrupt input.
+    static const int MAX_DEPTH = 64;
+    uint8_t tag;
+    if (depth > MAX_DEPTH || !cursor->read(&tag))
+        return false;
+    write<uint8_t>(tag);
+
+    switch (tag) {
+        case TAG_NULL:
+        case TAG_TRUE:
+        case TAG_FALSE:
+            return true;
+        case TAG_CHAR: {
+            char c;
+            if (!cursor->read(&c))
+                return false;
+            write<char>(c);
+            return true;
+        }
+        case TAG_INT32: {
+            int32_t i;
+            if (!cursor->read(&i))
+                return false;
+            write<int32_t>(i);
+            return true;
+        }
+        case TAG_NUMBER:
+        case TAG_DATE: {
+            double d;
+            if (!cursor->read(&d))
+                return false;
+            write<double>(d);
+            return true;
+        }
+        case TAG_STRING:
+            return copyPortableString(cursor);
+        case TAG_NAME:
+            return copyName(cursor);
+        case TAG_OBJECT:
+        case TAG_ARRAY: {
+            uint32_t count;
+            if (!cursor->read(&count))
+                return false;
+            write<uint32_t>(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                if (TAG_OBJECT == tag && !copyName(cursor))
+                    return false;
+                if (!copyPortableValue(cursor, depth + 1))
+                    return false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+EventBuffer::writeName(const blpapi::Name& name)
+{
+    if (d_portable)
+        writeString(name.string(), name.length());
+    else
+        write<blpapi_Name_t*>(name.impl());
+}
+
+void
+EventBuffer::writeMessage(const blpapi::Message& msg,
+                          const Subscription* subscription)
+{
+    writeName(msg.messageType());
+    const char *topic = msg.topicName();
+    writeString(topic, strlen(topic));
+
+    write<uint32_t>(msg.numCorrelationIds());
+    for (int i = 0; i < msg.numCorrelationIds(); ++i) {
+        blpapi::CorrelationId cid = msg.correlationId(i);
+        write<uint8_t>(cid.valueType());
+        if (cid.valueType() == blpapi::CorrelationId::INT_VALUE ||
+            cid.valueType() == blpapi::CorrelationId::AUTOGEN_VALUE) {
+            write<int64_t>(cid.asInteger());
+        } else {
+            write<int64_t>(0);
+        }
+        write<int32_t>(cid.classId());
+    }
+
+    if (subscription && !subscription->projection.empty())
+        writeProjection(msg.asElement(), subscription->projection);
+    else
+        writeElement(msg.asElement());
+}
+
+void
+EventBuffer::writeProjection(const blpapi::Element& e,
+                             const std::vector<blpapi::Name>& projection)
+{
+    // Mirrors 'Session::projectionToValue'.  Reserve the element count
+    // and patch it once known.
+    write<uint8_t>(TAG_OBJECT);
+    size_t countPos = d_data.size();
+    write<uint32_t>(0);
+    uint32_t count = 0;
+
+    for (size_t i = 0; i < projection.size(); ++i) {
+        blpapi::Element se;
+        if (0 != e.getElement(&se, projection[i]))
+            continue;
+        writeName(se.name());
+        if (se.isComplexType() || se.isArray()) {
+            writeElement(se);
+        } else {
+            writeValue(se, 0);
+        }
+        ++count;
+    }
+    memcpy(&d_data[countPos], &count, sizeof(count));
+}
+
+void
+EventBuffer::writeElement(const blpapi::Element& e)
+{
+    // Mirrors 'Session::elementToValue'.
+    if (e.isComplexType()) {
+        int numElements = e.numElements();
+        write<uint8_t>(TAG_OBJECT);
+        write<uint32_t>(numElements);
+        for (int i = 0; i < numElements; ++i) {
+            blpapi::Element se = e.getElement(i);
+            writeName(se.name());
+            if (se.isComplexType() || se.isArray()) {
+                writeElement(se);
+            } else {
+                writeValue(se, 0);
+            }
+        }
+    } else if (e.isArray()) {
+        int numValues = e.numValues();
+        write<uint8_t>(TAG_ARRAY);
+        write<uint32_t>(numValues);
+        for (int i = 0; i < numValues; ++i) {
+            writeValue(e, i);
+        }
+    } else {
+        writeValue(e, 0);
+    }
+}
+
+void
+EventBuffer::writeValue(const blpapi::Element& e, int idx)
+{
+    // Mirrors 'Session::elementValueToValue'.
+    if (e.isNull()) {
+        write<uint8_t>(TAG_NULL);
+        return;
+    }
+
+    switch (e.datatype()) {
+        case blpapi::DataType::BOOL:
+            write<uint8_t>(e.getValueAsBool(idx) ? TAG_TRUE : TAG_FALSE);
+            return;
+        case blpapi::DataType::CHAR:
+            write<uint8_t>(TAG_CHAR);
+            write<char>(e.getValueAsChar(idx));
+            return;
+        case blpapi::DataType::BYTE:
+        case blpapi::DataType::INT32:
+            write<uint8_t>(TAG_INT32);
+            write<int32_t>(e.getValueAsInt32(idx));
+            return;
+        case blpapi::DataType::FLOAT32:
+            write<uint8_t>(TAG_NUMBER);
+            write<double>(e.getValueAsFloat32(idx));
+            return;
+        case blpapi::DataType::FLOAT64:
+            write<uint8_t>(TAG_NUMBER);
+            write<double>(e.getValueAsFloat64(idx));
+            return;
+        case blpapi::DataType::ENUMERATION:
+            write<uint8_t>(TAG_NAME);
+            writeName(e.getValueAsName(idx));
+            return;
+        case blpapi::DataType::INT64: {
+            static const blpapi::Int64 MAX_DOUBLE_INT = 9007199254740992LL;
+            blpapi::Int64 i = e.getValueAsInt64(idx);
+            if ((i >= -MAX_DOUBLE_INT) && (i <= MAX_DOUBLE_INT)) {
+                write<uint8_t>(TAG_NUMBER);
+                write<double>(static_cast<double>(i));
+                return;
+            }
+            break;
+        }
+        case blpapi::DataType::STRING: {
+            const char *str = e.getValueAsString(idx);
+            write<uint8_t>(TAG_STRING);
+            writeString(str, strlen(str));
+            return;
+        }
+        case blpapi::DataType::DATE:
+        case blpapi::DataType::TIME:
+        case blpapi::DataType::DATETIME: {
+            double ms;
+            if (mkepochms(&ms, e.getValueAsDatetime(idx), e.datatype())) {
+                write<uint8_t>(TAG_DATE);
+                write<double>(ms);
+                return;
+            }
+            break;
+        }
+        case blpapi::DataType::SEQUENCE:
+            writeElement(e.getValueAsElement(idx));
+            return;
+        default:
+            break;
+    }
+
+    write<uint8_t>(TAG_NULL);
+}
+
+bool
+EventRecorder::open(const char* path)
+{
+    d_file = fopen(path, "wb");
+    if (!d_file)
+        return false;
+    if (1 != fwrite(MAGIC, sizeof(MAGIC), 1, d_file) ||
+        1 != fwrite(&VERSION, sizeof(VERSION), 1, d_file)) {
+        fclose(d_file);
+        d_file = 0;
+        return false;
+    }
+    return true;
+}
+
+void
+EventRecorder::close()
+{
+    pthread_mutex_lock(&d_mutex);
+    if (d_file) {
+        fclose(d_file);
+        d_file = 0;
+    }
+    pthread_mutex_unlock(&d_mutex);
+}
+
+void
+EventRecorder::record(const blpapi::Event& ev)
+{
+    // Encode outside the lock so that dispatcher threads only contend
+    // for the write itself.  Events which fail to encode are not
+    // recorded.
+    double time = mknowms();
+    int32_t eventType = ev.eventType();
+    EventBuffer *buffer;
+    try {
+        buffer = new EventBuffer(ev, SubscriptionMap(), MessageSet(), true);
+    } catch (blpapi::Exception&) {
+        return;
+    }
+    uint32_t length = sizeof(time) + sizeof(eventType) + buffer->size();
+
+    // Once a write fails the recording ends; replay stops at the partial
+    // record left behind.
+    pthread_mutex_lock(&d_mutex);
+    if (d_file &&
+        (1 != fwrite(&length, sizeof(length), 1, d_file) ||
+         1 != fwrite(&time, sizeof(time), 1, d_file) ||
+         1 != fwrite(&eventType, sizeof(eventType), 1, d_file) ||
+         1 != fwrite(buffer->data(), buffer->size(), 1, d_file))) {
+        fclose(d_file);
+        d_file = 0;
+    }
+    pthread_mutex_unlock(&d_mutex);
+
+    delete buffer;
+}
+
+uint32_t
+WireDictionary::id(blpapi_Name_t* name)
+{
+    std::map<blpapi_Name_t*, uint32_t>::const_iterator it = d_ids.find(name);
+    if (it != d_ids.end())
+        return it->second;
+
+    // Names are seldom new; trade the read lock for the write lock to
+    // assign one, as another thread may have meanwhile.
+    pthread_rwlock_unlock(&d_lock);
+    pthread_rwlock_wrlock(&d_lock);
+    uint32_t id;
+    it = d_ids.find(name);
+    if (it != d_ids.end()) {
+        id = it->second;
+    } else {
+        id = d_names.size();
+        d_ids.insert(std::make_pair(name, id));
+        d_names.push_back(name);
+        d_offsets.push_back(d_offsets.back() + sizeof(uint32_t) +
+                            blpapi_Name_length(name) + 1);
+    }
+    pthread_rwlock_unlock(&d_lock);
+    pthread_rwlock_rdlock(&d_lock);
+    return id;
+}
+
+size_t
+WireDictionary::stringsSize(uint32_t count) const
+{
+    lock();
+    size_t size = d_offsets[count];
+    unlock();
+    return size;
+}
+
+void
+WireDictionary::copyStrings(uint32_t count, char* out) const
+{
+    lock();
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t length = blpapi_Name_length(d_names[i]);
+        memcpy(out, &length, sizeof(length));
+        memcpy(out + sizeof(length), blpapi_Name_string(d_names[i]),
+               length + 1);
+        out += sizeof(length) + length + 1;
+    }
+    unlock();
+}
+
+WireFragment::WireFragment(int eventType, const EventBuffer& buffer,
+                           WireDictionary* dictionary)
+    : d_dictionary(dictionary), d_messages(0), d_names(0)
+{
+    // Mirrors 'EventBuffer::fromPortable', for trusted data.
+    EventBuffer::Reader reader(buffer);
+    d_messages = reader.read<uint32_t>();
+    d_body.reserve(buffer.size() + d_messages * sizeof(int32_t));
+
+    d_dictionary->lock();
+    for (uint32_t i = 0; i < d_messages; ++i) {
+        write<int32_t>(eventType);
+        writeName(reader.read<blpapi_Name_t*>());
+        copyString(&reader);
+
+        uint32_t numCorrelationIds = reader.read<uint32_t>();
+        write<uint32_t>(numCorrelationIds);
+        for (uint32_t j = 0; j < numCorrelationIds; ++j) {
+            write<uint8_t>(reader.read<uint8_t>());
+            write<int64_t>(reader.read<int64_t>());
+            write<int32_t>(reader.read<int32_t>());
+        }
+
+        copyValue(&reader);
+    }
+    d_names = d_dictionary->size();
+    d_dictionary->unlock();
+}
+
+void
+WireFragment::copyString(EventBuffer::Reader* reader)
+{
+    uint32_t length;
+    const char *str = reader->readString(&length);
+    write<uint32_t>(length);
+    size_t n = d_body.size();
+    d_body.resize(n + length + 1);
+    memcpy(&d_body[n], str, length + 1);
+}
+
+void
+WireFragment::copyValue(EventBuffer::Reader* reader)
+{
+    uint8_t tag = reader->read<uint8_t>();
+    write<uint8_t>(tag);
+
+    switch (tag) {
+        case EventBuffer::TAG_CHAR:
+            write<char>(reader->read<char>());
+            break;
+        case EventBuffer::TAG_INT32:
+            write<int32_t>(reader->read<int32_t>());
+            break;
+        case EventBuffer::TAG_NUMBER:
+        case EventBuffer::TAG_DATE:
+            write<double>(reader->read<double>());
+            break;
+        case EventBuffer::TAG_STRING:
+            copyString(reader);
+            break;
+        case EventBuffer::TAG_NAME:
+            writeName(reader->read<blpapi_Name_t*>());
+            break;
+        case EventBuffer::TAG_OBJECT:
+        case EventBuffer::TAG_ARRAY: {
+            uint32_t count = reader->read<uint32_t>();
+            write<uint32_t>(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                if (EventBuffer::TAG_OBJECT == tag)
+                    writeName(reader->read<blpapi_Name_t*>());
+                copyValue(reader);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void
+WireEncoder::append(const WireFragment& fragment)
+{
+    if (fragment.numNames() > d_names) {
+        d_names = fragment.numNames();
+        d_names_size = d_dictionary.stringsSize(d_names);
+    }
+    if (fragment.size() > 0) {
+        size_t n = d_body.size();
+        d_body.resize(n + fragment.size());
+        memcpy(&d_body[n], fragment.data(), fragment.size());
+    }
+    d_messages += fragment.numMessages();
+}
+
+void
+WireEncoder::copyTo(char* out) const
+{
+    memcpy(out, MAGIC, sizeof(MAGIC));
+    memcpy(out + 4, &VERSION, sizeof(VERSION));
+    memcpy(out + 8, &d_names, sizeof(d_names));
+    memcpy(out + 12, &d_messages, sizeof(d_messages));
+    out += HEADER_SIZE;
+
+    d_dictionary.copyStrings(d_names, out);
+    out += d_names_size;
+
+    if (!d_body.empty())
+        memcpy(out, &d_body[0], d_body.size());
+}
+
+void
+WireEncoder::clear()
+{
+    d_names = 0;
+    d_names_size = 0;
+    d_body.clear();
+    d_messages = 0;
+}
+
+Handle<Value>
+Session::bufferToValue(EventBuffer::Reader* reader)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    switch (reader->read<uint8_t>()) {
+        case EventBuffer::TAG_TRUE:
+            return True();
+        case EventBuffer::TAG_FALSE:
+            return False();
+        case EventBuffer::TAG_CHAR: {
+            char c = reader->read<char>();
+            return String::New(&c, 1);
+        }
+        case EventBuffer::TAG_INT32:
+            return Integer::New(reader->read<int32_t>());
+        case EventBuffer::TAG_NUMBER:
+            return Number::New(reader->read<double>());
+        case EventBuffer::TAG_STRING: {
+            uint32_t length;
+            const char *str = reader->readString(&length);
+            return String::New(str, length);
+        }
+        case EventBuffer::TAG_NAME:
+            return nameToString(reader->read<blpapi_Name_t*>());
+        case EventBuffer::TAG_DATE:
+            return Date::New(reader->read<double>());
+        case EventBuffer::TAG_OBJECT: {
+            uint32_t numElements = reader->read<uint32_t>();
+            Local<Object> o = Object::New();
+            for (uint32_t i = 0; i < numElements; ++i) {
+                Handle<String> name =
+                    nameToString(reader->read<blpapi_Name_t*>());
+                o->Set(name, bufferToValue(reader),
+                       (PropertyAttribute)(ReadOnly | DontDelete));
+            }
+            return o;
+        }
+        case EventBuffer::TAG_ARRAY: {
+            uint32_t numValues = reader->read<uint32_t>();
+            Local<Object> o = Array::New(numValues);
+            for (uint32_t i = 0; i < numValues; ++i) {
+                o->Set(i, bufferToValue(reader));
+            }
+            return o;
+        }
+        default:
+            break;
+    }
+
+    return Null();
+}
+
+Handle<String>
+Session::eventTypeToString(blpapi::Event::EventType et)
+{
+    if (et < 0 || et >= static_cast<int>(ARRAY_SIZE(s_event_types)) ||
+        s_event_types[et].IsEmpty())
+        return s_event_types[0];
+    return s_event_types[et];
+}
+
+Local<Object>
+Session::newMessage(blpapi::Event::EventType et, Handle<String> messageType,
+                    Handle<String> topic, Handle<Array> correlations)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    Local<Object> o = s_message_template->NewInstance();
+    o->ForceSet(s_event_type, eventTypeToString(et),
+                (PropertyAttribute)(ReadOnly | DontDelete));
+    o->ForceSet(s_message_type, messageType,
+                (PropertyAttribute)(ReadOnly | DontDelete));
+    o->ForceSet(s_topic_name, topic, (PropertyAttribute)(ReadOnly | DontDelete));
+    o->ForceSet(s_correlations, correlations,
+                (PropertyAttribute)(ReadOnly | DontDelete));
+    return o;
+}
+
+Local<Object>
+Session::correlationToValue(int64_t value, int classId)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    Local<Object> o = s_correlation_template->NewInstance();
+    o->Set(s_value, Integer::New(value));
+    o->Set(s_class_id, Integer::New(classId));
+    return o;
+}
+
+Handle<String>
+Session::nameToString(const blpapi::Name& name)
+{
+    return nameToString(name.impl());
+}
+
+Handle<String>
+Session::nameToString(blpapi_Name_t* name)
+{
+    NameMap::const_iterator it = d_names.find(name);
+    if (it != d_names.end())
+        return it->second;
+
+    Persistent<String> s = Persistent<String>::New(
+            String::NewSymbol(blpapi_Name_string(name),
+                              blpapi_Name_length(name)));
+    d_names.insert(std::make_pair(name, s));
+    ++d_interned;
+    return s;
+}
+
+Handle<String>
+Session::topicToString(const char* topic)
+{
+    TopicMap::const_iterator it = d_topics.find(topic);
+    if (it != d_topics.end())
+        return it->second;
+
+    Persistent<String> s = Persistent<String>::New(String::NewSymbol(topic));
+    d_topics.insert(std::make_pair(strdup(topic), s));
+    ++d_interned;
+    return s;
+}
+
+static Local<Object>
+histogramToValue(const LatencyHistogram& h)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    Local<Object> o = Object::New();
+    o->Set(String::New("count"), Number::New(h.count()));
+    o->Set(String::New("min"), Number::New(h.min()));
+    o->Set(String::New("mean"),
+           Number::New(h.count() ? (double)h.sum() / h.count() : 0));
+    o->Set(String::New("p50"), Number::New(h.quantile(0.5)));
+    o->Set(String::New("p90"), Number::New(h.quantile(0.9)));
+    o->Set(String::New("p99"), Number::New(h.quantile(0.99)));
+    o->Set(String::New("p999"), Number::New(h.quantile(0.999)));
+    o->Set(String::New("max"), Number::New(h.max()));
+    return o;
+}
+
+Local<Object>
+Session::latencyToValue()
+{
+    // Use the HandleScope of the calling function for speed.
+
+    Local<Object> eventTypes = Object::New();
+    for (std::map<int, EventLatency>::const_iterator it =
+            d_event_latency.begin(); it != d_event_latency.end(); ++it) {
+        Local<Object> o = Object::New();
+        o->Set(String::New("queue"), histogramToValue(it->second.queue));
+        o->Set(String::New("dispatch"),
+               histogramToValue(it->second.dispatch));
+        o->Set(String::New("total"), histogramToValue(it->second.total));
+        eventTypes->Set(eventTypeToString(
+                    static_cast<blpapi::Event::EventType>(it->first)), o);
+    }
+
+    Local<Object> messageTypes = Object::New();
+    for (std::map<blpapi_Name_t*, MessageLatency>::const_iterator it =
+            d_message_latency.begin(); it != d_message_latency.end(); ++it) {
+        Local<Object> o = Object::New();
+        o->Set(String::New("dispatch"),
+               histogramToValue(it->second.dispatch));
+        o->Set(String::New("total"), histogramToValue(it->second.total));
+        messageTypes->Set(nameToString(it->first), o);
+    }
+
+    Local<Object> o = Object::New();
+    o->Set(String::New("eventTypes"), eventTypes);
+    o->Set(String::New("messageTypes"), messageTypes);
+    return o;
+}
+
+void
+Session::resetLatency()
+{
+    for (std::map<int, EventLatency>::iterator it =
+            d_event_latency.begin(); it != d_event_latency.end(); ++it) {
+        it->second.queue.reset();
+        it->second.dispatch.reset();
+        it->second.total.reset();
+    }
+    for (std::map<blpapi_Name_t*, MessageLatency>::iterator it =
+            d_message_latency.begin(); it != d_message_latency.end(); ++it) {
+        it->second.dispatch.reset();
+        it->second.total.reset();
+    }
+}
+
+Local<Object>
+Session::messageToValue(const blpapi::Event& ev, const blpapi::Message& msg)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    blpapi::Event::EventType et = ev.eventType();
+    DecodingEvent decoding(this, ev);
+
+    Local<Array> correlations = Array::New(msg.numCorrelationIds());
+    for (int i = 0, j = 0; i < msg.numCorrelationIds(); ++i) {
+        blpapi::CorrelationId cid = msg.correlationId(i);
+        // Only pack user-specified integers and auto-generated
+        // values into the correlations array returned to the user.
+        if (cid.valueType() == blpapi::CorrelationId::INT_VALUE ||
+            cid.valueType() == blpapi::CorrelationId::AUTOGEN_VALUE) {
+            correlations->Set(j++, correlationToValue(cid.asInteger(),
+                                                      cid.classId()));
+        } else {
+            correlations->Set(j++, Object::New());
+        }
+    }
+
+    Local<Object> o = newMessage(et, nameToString(msg.messageType()),
+                                 topicToString(msg.topicName()),
+                                 correlations);
+
+    // Responses to requests sent with the 'columnar' option decode arrays
+    // of sequences into columns.  The request is forgotten once anything
+    // other than a partial response arrives for it.
+    if (!d_columnar.empty() && msg.numCorrelationIds() > 0) {
+        blpapi::CorrelationId cid = msg.correlationId(0);
+        if (cid.valueType() == blpapi::CorrelationId::INT_VALUE) {
+            std::set<int>::iterator it = d_columnar.find(
+                    static_cast<int>(cid.asInteger()));
+            if (it != d_columnar.end()) {
+                d_decode_columnar = true;
+                if (et != blpapi::Event::PARTIAL_RESPONSE)
+                    d_columnar.erase(it);
+            }
+        }
+    }
+
+    // In lazy mode subscription data fields are decoded on first access,
+    // unless too many lazy objects already pin their events.  Otherwise
+    // subscriptions with a projection decode only those fields.
+    const Subscription *subscription = 0;
+    if (et == blpapi::Event::SUBSCRIPTION_DATA)
+        subscription = findSubscription(d_subscriptions, msg);
+
+    bool lazy = d_lazy && et == blpapi::Event::SUBSCRIPTION_DATA;
+    if (lazy && d_max_lazy && d_lazy_pinned >= d_max_lazy) {
+        ++d_lazy_eager;
+        lazy = false;
+    }
+
+    if (lazy) {
+        o->Set(s_data, lazyElementToValue(ev, msg.asElement()));
+    } else if (subscription && !subscription->projection.empty()) {
+        o->Set(s_data, projectionToValue(msg.asElement(),
+                                         subscription->projection));
+    } else {
+        o->Set(s_data, elementToValue(msg.asElement()));
+    }
+    d_decode_columnar = false;
+
+    return o;
+}
+
+Local<Object>
+Session::bufferToMessage(blpapi::Event::EventType et,
+                         EventBuffer::Reader* reader,
+                         blpapi_Name_t** messageType)
+{
+    // Use the HandleScope of the calling function for speed.
+    //
+    // Mirrors 'messageToValue' for a message encoded in an 'EventBuffer'.
+
+    *messageType = reader->read<blpapi_Name_t*>();
+    uint32_t length;
+    const char *topic = reader->readString(&length);
+
+    uint32_t numCorrelationIds = reader->read<uint32_t>();
+    Local<Array> correlations = Array::New(numCorrelationIds);
+    for (uint32_t i = 0; i < numCorrelationIds; ++i) {
+        uint8_t valueType = reader->read<uint8_t>();
+        int64_t value = reader->read<int64_t>();
+        int32_t classId = reader->read<int32_t>();
+        if (valueType == blpapi::CorrelationId::INT_VALUE ||
+            valueType == blpapi::CorrelationId::AUTOGEN_VALUE) {
+            correlations->Set(i, correlationToValue(value, classId));
+        } else {
+            correlations->Set(i, Object::New());
+        }
+    }
+
+    Local<Object> o = newMessage(et, nameToString(*messageType),
+                                 topicToString(topic), correlations);
+    o->Set(s_data, bufferToValue(reader));
+
+    return o;
+}
+
+void
+Session::deliver(PendingBatch* batch, blpapi::Event::EventType et,
+                 blpapi_Name_t* messageType, Handle<Object> message)
+{
+    // Preserve ordering with respect to any pending wire chunk
+    flushWire();
+
+    // In batch mode consecutive SUBSCRIPTION_DATA messages of the same
+    // type are collected and emitted as one array, bounded by 'maxBatch'.
+    if (d_batch && et == blpapi::Event::SUBSCRIPTION_DATA) {
+        if (batch->length > 0 &&
+            (messageType != batch->type || batch->length == d_max_batch))
+            flushBatch(batch);
+        if (0 == batch->length) {
+            batch->type = messageType;
+            batch->messages = Array::New();
+        }
+        batch->messages->Set(batch->length++, message);
+        return;
+    }
+
+    // Preserve ordering with respect to any pending batch
+    flushBatch(batch);
+
+    Handle<Value> argv[2];
+    argv[0] = nameToString(messageType);
+    argv[1] = message;
+
+    this->emit(ARRAY_SIZE(argv), argv);
+}
+
+void
+Session::flushBatch(PendingBatch* batch)
+{
+    // At most one of the batch and the wire chunk is pending.
+    flushWire();
+    if (0 == batch->length)
+        return;
+
+    Handle<Value> argv[2];
+    argv[0] = nameToString(batch->type);
+    argv[1] = batch->messages;
+    batch->length = 0;
+
+    this->emit(ARRAY_SIZE(argv), argv);
+}
+
+void
+Session::flushWire()
+{
+    // Use the HandleScope of the calling function for speed.
+
+    if (0 == d_wire_encoder.numMessages())
+        return;
+
+    Handle<Value> size = Integer::NewFromUnsigned(d_wire_encoder.size());
+    Local<Object> chunk = s_array_buffer->NewInstance(1, &size);
+    d_wire_encoder.copyTo(static_cast<char*>(
+                chunk->GetIndexedPropertiesExternalArrayData()));
+    d_wire_encoder.clear();
+
+    Handle<Value> argv[2];
+    argv[0] = s_wire_data;
+    argv[1] = chunk;
+
+    this->emit(ARRAY_SIZE(argv), argv);
+}
+
+void
+Session::processEvents(uv_async_t *async, int status)
+{
+    HandleScope scope;
+
+    Session *session = reinterpret_cast<Session *>(async->data);
+
+    // Handlers may destroy the session; keep the wrapper alive while the
+    // queue is drained.
+    Local<Object> self = Local<Object>::New(session->handle_);
+
+    PendingBatch batch;
+    ++session->d_drains;
+    EventStringResource::settle();
+
+    // Drain everything published so far, unless the drain budget runs
+    // out first.  Events pushed after the queue is observed empty are
+    // followed by another 'uv_async_send'.
+    uint64_t start = session->d_max_drain_time ? uv_hrtime() : 0;
+    uint32_t drained = 0;
+    QueuedEvent qe;
+    while (session->d_que.pop(&qe)) {
+        // Let producers waiting for a free slot resume
+        if (session->d_waiters)
+            session->broadcast(&session->d_drained);
+
+        blpapi::Event::EventType et =
+            static_cast<blpapi::Event::EventType>(qe.eventType);
+        uint64_t dequeued = qe.received ? uv_hrtime() : 0;
+        if (session->d_overloaded || session->d_slow_notified) {
+            session->checkWatermarks(&batch);
+
+        }
+        if (qe.conflated) {
+            session->deliverConflated(&batch, *qe.conflated);
+            drained += qe.conflated->size();
+            delete qe.conflated;
+            qe.conflated = 0;
+        }
+
+        // Shed the oldest subscription data until the backlog is back
+        // down to the low watermark.  The conflated updates taken ahead of
+        // it were delivered above, as the conflator no longer holds them.
+        if (session->d_overloaded &&
+            session->d_overflow == OVERFLOW_DROP_OLDEST &&
+            et == blpapi::Event::SUBSCRIPTION_DATA) {
+            qe.release();
+            ++session->d_dropped;
+            continue;
+        }
+        if (qe.wire) {
+            // Copy messages encoded on the dispatcher thread into the
+            // pending wire chunk, emitted once large enough.
+            if (batch.length > 0)
+                session->flushBatch(&batch);
+            session->d_wire_encoder.append(*qe.wire);
+            drained += qe.wire->numMessages();
+            if (session->d_wire_encoder.size() >= WIRE_CHUNK_SIZE)
+                session->flushWire();
+            delete qe.wire;
+            qe.wire = 0;
+        } else if (qe.buffer) {
+            // Materialize messages decoded on the dispatcher thread
+            EventBuffer::Reader reader(*qe.buffer);
+            uint32_t numMessages = reader.read<uint32_t>();
+            uint64_t begin = dequeued;
+            for (uint32_t i = 0; i < numMessages; ++i) {
+                blpapi_Name_t *messageType;
+                Local<Object> o = session->bufferToMessage(et, &reader,
+                                                           &messageType);
+                session->deliver(&batch, et, messageType, o);
+                if (et == blpapi::Event::SUBSCRIPTION_STATUS)
+                    session->pruneSubscriptions(messageType, o);
+                if (qe.received)
+                    begin = session->recordMessageLatency(qe, messageType,
+                                                          begin);
+            }
+            drained += numMessages;
+            delete qe.buffer;
+            qe.buffer = 0;
+        } else {
+            uint64_t begin = dequeued;
+            blpapi::MessageIterator msgIter(qe.event);
+            for (uint32_t i = 0; msgIter.next(); ++i) {
+                if (qe.skip.contains(i))
+                    continue;
+                const blpapi::Message& msg = msgIter.message();
+                Local<Object> o = session->messageToValue(qe.event, msg);
+                session->deliver(&batch, et, msg.messageType().impl(), o);
+                if (et == blpapi::Event::SUBSCRIPTION_STATUS)
+                    session->pruneSubscriptions(msg.messageType().impl(),
+                                                o);
+                ++drained;
+                if (qe.received)
+                    begin = session->recordMessageLatency(
+                                qe, msg.messageType().impl(), begin);
+            }
+        }
+
+        if (qe.received) {
+            uint64_t end = uv_hrtime();
+            EventLatency& latency = session->d_event_latency[et];
+            latency.queue.record(dequeued - qe.received);
+            latency.dispatch.record(end - dequeued);
+            latency.total.record(end - qe.received);
+        }
+
+        // Yield to the rest of the event loop once the budget is spent,
+        // re-arming the async handle to continue on the next iteration.
+        if ((session->d_max_drain_messages &&
+             drained >= session->d_max_drain_messages) ||
+            (session->d_max_drain_time &&
+             uv_hrtime() - start >= session->d_max_drain_time)) {
+            if (session->d_async) {
+                ++session->d_yields;
+                uv_async_send(session->d_async);
+            }
+            break;
         }
     }
 
-    blpapi::CorrelationId cid(cidi);
+    if (session->d_overloaded || session->d_slow_notified)
+        session->checkWatermarks(&batch);
 
-    if (args.Length() == 5) {
-        std::vector<char> labelv;
-        Local<String> s = args[4]->ToString();
-        labelv.reserve(s->Utf8Length() + 1);
-        int len = s->WriteUtf8(&labelv[0]);
-        session->d_session->sendRequest(request, cid, 0, &labelv[0], len);
-    } else {
-        session->d_session->sendRequest(request, cid);
+    // Deliver conflated updates and bars which are due, and time the next
+    // ones to fall due.
+    uint64_t delay = session->flushConflations(&batch);
+    uint64_t barDelay = session->flushBars(&batch);
+    if (barDelay && (0 == delay || barDelay < delay))
+        delay = barDelay;
+    session->flushBatch(&batch);
+
+    if (delay && session->d_timer)
+        uv_timer_start(session->d_timer, Session::timerExpired, delay, 0);
+}
+
+uint64_t
+Session::recordMessageLatency(const QueuedEvent& qe,
+                              blpapi_Name_t* messageType, uint64_t begin)
+{
+    // Messages handed over in a batch are timed when added to the batch.
+    uint64_t end = uv_hrtime();
+    MessageLatency& latency = d_message_latency[messageType];
+    latency.dispatch.record(end - begin);
+    latency.total.record(end - qe.received);
+    return end;
+}
+
+void
+Session::checkWatermarks(PendingBatch* batch)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    if (d_overloaded && !d_slow_notified) {
+        d_slow_notified = true;
+        d_slow_drain = d_drains;
+        notifySlowConsumer(batch, true);
     }
 
-    BLPAPI_EXCEPTION_CATCH_RETURN
+    if (d_overloaded && d_que.depth() <= d_low_watermark) {
+        __sync_bool_compare_and_swap(&d_overloaded, 1, 0);
+        if (d_blocked)
+            broadcast(&d_unblocked);
+    }
 
-    return scope.Close(Integer::New(cidi));
+    // The backlog is reported cleared no sooner than the drain after the
+    // one which reported it, so that the two are never emitted together;
+    // should the flag be raised again meanwhile, neither is.
+    if (!d_overloaded && d_slow_notified) {
+        if (d_slow_drain == d_drains) {
+            if (d_async)
+                uv_async_send(d_async);
+            return;
+        }
+        d_slow_notified = false;
+        notifySlowConsumer(batch, false);
+    }
 }
 
-Handle<Value>
-Session::elementToValue(const blpapi::Element& e)
+void
+Session::notifySlowConsumer(PendingBatch* batch, bool slow)
 {
-    if (e.isComplexType()) {
-        int numElements = e.numElements();
-        Local<Object> o = Object::New();
-        for (int i = 0; i < numElements; ++i) {
-            blpapi::Element se = e.getElement(i);
+    // Use the HandleScope of the calling function for speed.
+
+    static const char *overflowNames[] = { "block", "dropOldest", "conflate" };
+
+    Local<String> type = String::New(slow ? "SlowConsumer"
+                                          : "SlowConsumerCleared");
+
+    Local<Object> data = Object::New();
+    data->Set(String::New("depth"), Number::New(d_que.depth()));
+    data->Set(String::New("highWatermark"), Number::New(d_high_watermark));
+    data->Set(String::New("lowWatermark"), Number::New(d_low_watermark));
+    data->Set(String::New("overflow"),
+              String::New(overflowNames[d_overflow]));
+
+    Local<Object> o = newMessage(blpapi::Event::ADMIN, type, String::Empty(),
+                                 Array::New(0));
+    o->Set(s_data, data);
+
+    // Preserve ordering with respect to any pending batch
+    flushBatch(batch);
+
+    Handle<Value> argv[2];
+    argv[0] = type;
+    argv[1] = o;
+
+    this->emit(ARRAY_SIZE(argv), argv);
+}
+
+uint64_t
+Session::flushConflations(PendingBatch* batch)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    if (0 == d_conflator.merged())
+        return 0;
+
+    std::vector<ConflatedUpdate> updates;
+    uint64_t now = uv_now(uv_default_loop());
+    uint64_t nextDue;
+    d_conflator.collect(&updates, now, d_que.dequeued(), d_subscriptions,
+                        &nextDue);
+    deliverConflated(batch, updates);
+
+    // Updates held back by their interval are delivered by the timer.
+    return nextDue ? nextDue - now : 0;
+}
+
+void
+Session::deliverConflated(PendingBatch* batch,
+                          const std::vector<ConflatedUpdate>& updates)
+{
+    // Use the HandleScope of the calling function for speed.
+
+    for (size_t i = 0; i < updates.size(); ++i) {
+        const ConflatedUpdate& update = updates[i];
+
+        Local<Array> correlations = Array::New(1);
+        correlations->Set(0, correlationToValue(update.correlation,
+                                                update.classId));
+        Local<Object> o = newMessage(blpapi::Event::SUBSCRIPTION_DATA,
+                                     nameToString(update.messageType),
+                                     topicToString(update.topic.c_str()),
+                                     correlations);
+
+        Local<Object> data = Object::New();
+        for (size_t j = 0; j < update.fields.size(); ++j) {
+            const ConflatedUpdate::Field& field = update.fields[j];
+            if (!field.encoded.empty()) {
+                EventBuffer::Reader reader(field.encoded.data());
+                data->Set(nameToString(field.name), bufferToValue(&reader),
+                          (PropertyAttribute)(ReadOnly | DontDelete));
+                continue;
+            }
+            const blpapi::Element& se = field.element;
+            DecodingEvent decoding(this, field.event);
             Handle<Value> sev;
             if (se.isComplexType() || se.isArray()) {
                 sev = elementToValue(se);
             } else {
                 sev = elementValueToValue(se);
             }
-            o->Set(String::New(se.name().string(), se.name().length()),
-                   sev, (PropertyAttribute)(ReadOnly | DontDelete));
-        }
-        return o;
-    } else if (e.isArray()) {
-        int numValues = e.numValues();
-        Local<Object> o = Array::New(numValues);
-        for (int i = 0; i < numValues; ++i) {
-            o->Set(i, elementValueToValue(e, i));
+            data->Set(nameToString(field.name),
+                      sev, (PropertyAttribute)(ReadOnly | DontDelete));
         }
-        return o;
-    } else {
-        return elementValueToValue(e);
+        o->Set(s_data, data);
+
+        deliver(batch, blpapi::Event::SUBSCRIPTION_DATA,
+                update.messageType, o);
     }
 }
 
-static inline struct tm*
-mknow(struct tm* tm)
+uint64_t
+Session::flushBars(PendingBatch* batch)
 {
-    time_t sec;
-    time(&sec);
-    struct tm* ret = gmtime_r(&sec, tm);
-    return ret;
+    // Use the HandleScope of the calling function for speed.
+
+    if (0 == d_bars.completed() && d_subscriptions.empty())
+        return 0;
+
+    std::vector<CompletedBar> bars;
+    double now = mknowms();
+    double nextEnd;
+    d_bars.collect(&bars, now, &nextEnd);
+
+    for (size_t i = 0; i < bars.size(); ++i) {
+        const CompletedBar& completed = bars[i];
+        const Bar& bar = completed.bar;
+
+        Local<Array> correlations = Array::New(1);
+        correlations->Set(0, correlationToValue(completed.correlation,
+                                                completed.classId));
+        Local<Object> o = newMessage(blpapi::Event::SUBSCRIPTION_DATA,
+                                     nameToString(d_bar_name),
+                                     topicToString(completed.topic.c_str()),
+                                     correlations);
+
+        Local<Object> data = Object::New();
+        data->Set(String::New("start"), Date::New(bar.start));
+        data->Set(String::New("end"), Date::New(bar.end));
+        data->Set(String::New("open"), Number::New(bar.open));
+        data->Set(String::New("high"), Number::New(bar.high));
+        data->Set(String::New("low"), Number::New(bar.low));
+        data->Set(String::New("close"), Number::New(bar.close));
+        data->Set(String::New("volume"), Number::New(bar.volume));
+        data->Set(String::New("vwap"), Number::New(
+                    bar.volume > 0 ? bar.turnover / bar.volume
+                                   : std::numeric_limits<double>::quiet_NaN()));
+        data->Set(String::New("numTicks"), Integer::New(bar.ticks));
+        o->Set(s_data, data);
+
+        deliver(batch, blpapi::Event::SUBSCRIPTION_DATA, d_bar_name.impl(), o);
+    }
+
+    // Open time bars are completed by the timer once they end.
+    return nextEnd ? static_cast<uint64_t>(ceil(nextEnd - now)) + 1 : 0;
 }
 
-static inline time_t
-mkutctime(struct tm* tm)
+bool
+Session::addTick(const blpapi::Message& msg, const Subscription::Bars& bars,
+                 bool* wake)
 {
-    time_t ret;
-    char* tz = getenv("TZ");
-    setenv("TZ", "UTC", 1);
-    tzset();
-    ret = mktime(tm);
-    if (tz)
-        setenv("TZ", tz, 1);
-    else
-        unsetenv("TZ");
-    tzset();
-    return ret;
+    // Messages without a price are not trades, and are not aggregated; a
+    // missing size counts as no volume.  'wake' is raised when a bar
+    // completed.
+    blpapi::Element e = msg.asElement();
+    blpapi::Element pe;
+    double price;
+    if (0 != e.getElement(&pe, bars.price) || !mknumber(&price, pe))
+        return false;
+
+    blpapi::Element ve;
+    double size;
+    if (0 != e.getElement(&ve, bars.volume) || !mknumber(&size, ve))
+        size = 0;
+
+    blpapi::CorrelationId cid = msg.correlationId(0);
+    if (d_bars.add(static_cast<int>(cid.asInteger()), cid.classId(),
+                   msg.topicName(), bars, price, size, mknowms()))
+        *wake = true;
+    return true;
 }
 
-Handle<Value>
-Session::elementValueToValue(const blpapi::Element& e, int idx)
+void
+Session::timerExpired(uv_timer_t *timer, int status)
 {
-    if (e.isNull())
-        return Null();
+    Session *session = reinterpret_cast<Session *>(timer->data);
+    processEvents(session->d_async, status);
+}
 
-    switch (e.datatype()) {
-        case blpapi::DataType::BOOL:
-            return Boolean::New(e.getValueAsBool(idx));
-        case blpapi::DataType::CHAR: {
-            char c = e.getValueAsChar(idx);
-            return String::New(&c, 1);
-        }
-        case blpapi::DataType::BYTE:
-        case blpapi::DataType::INT32:
-            return Integer::New(e.getValueAsInt32(idx));
-        case blpapi::DataType::FLOAT32:
-            return Number::New(e.getValueAsFloat32(idx));
-        case blpapi::DataType::FLOAT64:
-            return Number::New(e.getValueAsFloat64(idx));
-        case blpapi::DataType::ENUMERATION: {
-            blpapi::Name n = e.getValueAsName(idx);
-            return String::New(n.string(), n.length());
-        }
-        case blpapi::DataType::INT64: {
-            // IEEE754 double can represent the range [-2^53, 2^53].
-            static const blpapi::Int64 MAX_DOUBLE_INT = 9007199254740992LL;
-            blpapi::Int64 i = e.getValueAsInt64(idx);
-            if ((i >= -MAX_DOUBLE_INT) && (i <= MAX_DOUBLE_INT))
-                return Number::New(static_cast<double>(i));
-            break;
-        }
-        case blpapi::DataType::STRING:
-            return String::New(e.getValueAsString(idx));
-        case blpapi::DataType::DATE: {
-            blpapi::Datetime dt = e.getValueAsDatetime(idx);
-            if (dt.hasParts(blpapi::DatetimeParts::DATE)) {
-                struct tm date;
-                date.tm_sec = 0;
-                date.tm_min = 0;
-                date.tm_hour = 0;
-                date.tm_mday = dt.day();
-                date.tm_mon = dt.month() - 1;
-                date.tm_year = dt.year() - 1900;
-                date.tm_wday = 0;
-                date.tm_yday = 0;
-                date.tm_isdst = 0;
-                time_t sec = mkutctime(&date);
-                double ms = sec * 1000.0L;
-                return Date::New(ms);
+void
+Session::closeAsync(uv_handle_t *handle)
+{
+    delete reinterpret_cast<uv_async_t *>(handle);
+}
+
+void
+Session::closeTimer(uv_handle_t *handle)
+{
+    delete reinterpret_cast<uv_timer_t *>(handle);
+}
+
+bool
+Session::processEvent(const blpapi::Event& ev, blpapi::Session* session)
+{
+    QueuedEvent qe;
+    qe.event = ev;
+    qe.eventType = ev.eventType();
+    if (d_latency)
+        qe.received = uv_hrtime();
+
+    if (d_recorder.isOpen())
+        d_recorder.record(ev);
+
+    admit(qe.eventType);
+
+    if (qe.eventType == blpapi::Event::SUBSCRIPTION_DATA) {
+        pthread_rwlock_rdlock(&d_subscriptions_lock);
+
+        // Merge messages of conflated subscriptions here; they are
+        // delivered by 'flushConflations' rather than with the event.
+        // While overloaded with the 'conflate' policy, every message of
+        // an integer correlation id is conflated.  The pending update of
+        // a subscription is delivered ahead of any of its messages which
+        // is not conflated, so that it never overwrites newer values.
+        // Cached subscriptions update the last value cache, and messages
+        // of those cached only are not delivered at all.  Ticks of bar
+        // subscriptions are aggregated and never delivered; their other
+        // messages are handled as usual.
+        bool conflateAll = d_overloaded && d_overflow == OVERFLOW_CONFLATE;
+        uint32_t numMessages = 0;
+        uint32_t numConflated = 0;
+        uint32_t numSkipped = 0;
+        bool wake = false;
+        if (!d_subscriptions.empty() || conflateAll ||
+            d_conflator.pending()) {
+            try {
+                blpapi::MessageIterator msgIter(ev);
+                for (; msgIter.next(); ++numMessages) {
+                    const blpapi::Message& msg = msgIter.message();
+                    const Subscription *subscription =
+                        findSubscription(d_subscriptions, msg);
+                    if (subscription && subscription->bars.kind !=
+                            Subscription::Bars::NONE &&
+                        addTick(msg, subscription->bars, &wake)) {
+                        qe.skip.insert(numMessages);
+                        ++numSkipped;
+                        continue;
+                    }
+                    if (subscription &&
+                        subscription->cache != Subscription::CACHE_NONE) {
+                        d_cache.update(msg, *subscription);
+                        if (subscription->cache ==
+                                Subscription::CACHE_ONLY) {
+                            qe.skip.insert(numMessages);
+                            ++numSkipped;
+                            continue;
+                        }
+                    }
+                    if (conflateAll && !subscription &&
+                        msg.numCorrelationIds() > 0 &&
+                        msg.correlationId(0).valueType() ==
+                            blpapi::CorrelationId::INT_VALUE)
+                        subscription = &OVERFLOW_CONFLATION;
+                    if (subscription &&
+                        (subscription->conflate >= 0 || conflateAll)) {
+                        d_conflator.merge(ev, msg, *subscription,
+                                          d_que.claimed());
+                        qe.skip.insert(numMessages);
+                        ++numConflated;
+                        ++numSkipped;
+                    } else if (d_conflator.pending()) {
+                        takeConflated(&qe, msg);
+                    }
+                }
+            } catch (blpapi::Exception&) {
             }
-            break;
         }
-        case blpapi::DataType::TIME: {
-            blpapi::Datetime dt = e.getValueAsDatetime(idx);
-            if (dt.hasParts(blpapi::DatetimeParts::TIME)) {
-                struct tm date;
-                mknow(&date);
-                date.tm_sec = dt.seconds();
-                date.tm_min = dt.minutes();
-                date.tm_hour = dt.hours();
-                date.tm_isdst = 0;
-                time_t sec = mkutctime(&date);
-                double ms = sec * 1000.0L;
-                if (dt.hasParts(blpapi::DatetimeParts::TIMEMILLI))
-                    ms += dt.milliSeconds();
-                return Date::New(ms);
+
+        // Subscription data may be decoded here, on the dispatcher thread,
+        // leaving only value materialization to the libuv thread.  On
+        // failure the event is decoded on the libuv thread as usual.
+        if ((d_predecode || d_wire) &&
+            (0 == numSkipped || numSkipped < numMessages)) {
+            try {
+                qe.buffer = new EventBuffer(ev, d_subscriptions, qe.skip);
+            } catch (blpapi::Exception&) {
+                qe.buffer = 0;
             }
-            break;
         }
-        case blpapi::DataType::DATETIME: {
-            blpapi::Datetime dt = e.getValueAsDatetime(idx);
-            struct tm date;
-            // Use date if present, otherwise default to "now".
-            if (dt.hasParts(blpapi::DatetimeParts::DATE)) {
-                date.tm_mday = dt.day();
-                date.tm_mon = dt.month() - 1;
-                date.tm_year = dt.year() - 1900;
-                date.tm_wday = 0;
-                date.tm_yday = 0;
-            } else {
-                mknow(&date);
-            }
-            // Use time if present, otherwise default to midnight.
-            if (dt.hasParts(blpapi::DatetimeParts::TIME)) {
-                date.tm_sec = dt.seconds();
-                date.tm_min = dt.minutes();
-                date.tm_hour = dt.hours();
-                date.tm_isdst = 0;
-            } else {
-                date.tm_sec = 0;
-                date.tm_min = 0;
-                date.tm_hour = 0;
-                date.tm_isdst = 0;
-            }
-            time_t sec = mkutctime(&date);
-            double ms = sec * 1000.0L;
-            if (dt.hasParts(blpapi::DatetimeParts::TIMEMILLI))
-                ms += dt.milliSeconds();
-            return Date::New(ms);
+
+        pthread_rwlock_unlock(&d_subscriptions_lock);
+
+        encodeWire(&qe);
+
+        if (numSkipped > 0 && numSkipped == numMessages) {
+            if (numConflated > 0 || wake)
+                uv_async_send(d_async);
+            return true;
+        }
+        if (wake)
+            uv_async_send(d_async);
+    } else if (d_conflator.pending()) {
+        // Deliver pending conflated updates ahead of the status of their
+        // subscriptions, such as 'SubscriptionTerminated'.
+        try {
+            blpapi::MessageIterator msgIter(ev);
+            while (msgIter.next())
+                takeConflated(&qe, msgIter.message());
+        } catch (blpapi::Exception&) {
         }
-        case blpapi::DataType::SEQUENCE:
-            return elementToValue(e.getValueAsElement(idx));
-        default:
-            break;
     }
 
-    return Null();
+    if (!enqueue(qe))
+        qe.release();
+    return true;
 }
 
-class StaticStringResource : public String::ExternalAsciiStringResource
+void
+Session::admit(int eventType)
 {
-  public:
-    StaticStringResource(const char* str)
-        : d_str(str) { d_len = strlen(d_str); }
-    StaticStringResource(const StaticStringResource& rhs)
-        : d_str(rhs.d_str), d_len(rhs.d_len) {}
-    ~StaticStringResource() {}
-
-    StaticStringResource& operator=(const StaticStringResource& rhs) {
-        d_str = rhs.d_str;
-        d_len = rhs.d_len;
-        return *this;
+    // Raise the overload flag once the backlog reaches the high
+    // watermark, waking the consumer to report it.
+    if (d_high_watermark && !d_overloaded &&
+        d_que.depth() >= d_high_watermark &&
+        __sync_bool_compare_and_swap(&d_overloaded, 0, 1))
+        uv_async_send(d_async);
+
+    // The 'block' policy holds back subscription data only, so that
+    // status and responses still get through.
+    if (d_overloaded && d_overflow == OVERFLOW_BLOCK &&
+        eventType == blpapi::Event::SUBSCRIPTION_DATA) {
+        __sync_fetch_and_add(&d_blocked_waits, 1);
+        pthread_mutex_lock(&d_drain_mutex);
+        ++d_blocked;
+        __sync_synchronize();
+        while (d_overloaded && !d_destroying)
+            waitForDrain(&d_unblocked);
+        --d_blocked;
+        pthread_mutex_unlock(&d_drain_mutex);
     }
+}
 
-    const char* data() const { return d_str; }
-    size_t length() const { return d_len; }
+void
+Session::encodeWire(QueuedEvent* qe)
+{
+    // Wire chunks are assembled on the libuv thread from the messages
+    // encoded here, on the producer thread.
+    if (!d_wire || !qe->buffer ||
+        qe->eventType != blpapi::Event::SUBSCRIPTION_DATA)
+        return;
 
-  private:
-    const char* d_str;
-    size_t d_len;
-};
+    qe->wire = new WireFragment(qe->eventType, *qe->buffer,
+                                &d_wire_dictionary);
+    delete qe->buffer;
+    qe->buffer = 0;
+}
+
+void
+Session::takeConflated(QueuedEvent* qe, const blpapi::Message& msg)
+{
+    if (0 == msg.numCorrelationIds() ||
+        msg.correlationId(0).valueType() != blpapi::CorrelationId::INT_VALUE)
+        return;
+
+    takeConflated(qe, static_cast<int>(msg.correlationId(0).asInteger()));
+}
+
+void
+Session::takeConflated(QueuedEvent* qe, int correlation)
+{
+    if (!qe->conflated)
+        qe->conflated = new std::vector<ConflatedUpdate>;
+    d_conflator.take(correlation, qe->conflated);
+    if (qe->conflated->empty()) {
+        delete qe->conflated;
+        qe->conflated = 0;
+    }
+}
+
+bool
+Session::enqueue(const QueuedEvent& qe)
+{
+    // When the queue is full, wake the consumer and wait for it to free
+    // a slot; this applies backpressure to the producing thread.
+    if (!d_que.push(qe)) {
+        __sync_fetch_and_add(&d_full_waits, 1);
+        pthread_mutex_lock(&d_drain_mutex);
+        ++d_waiters;
+        __sync_synchronize();
+        bool pushed;
+        while (!(pushed = d_que.push(qe)) && !d_destroying)
+            waitForDrain(&d_drained);
+        --d_waiters;
+        pthread_mutex_unlock(&d_drain_mutex);
+        if (!pushed)
+            return false;
+    }
 
-#define EVENT_TO_STRING(e) \
-    case blpapi::Event::e : \
-        static StaticStringResource s_##e(#e); \
-        return String::NewExternal(new StaticStringResource(s_##e))
+    updatePeakDepth();
+    uv_async_send(d_async);
+    return true;
+}
 
-static inline Handle<Value>
-eventTypeToString(blpapi::Event::EventType et)
+void
+Session::waitForDrain(pthread_cond_t* cond)
 {
-    switch (et) {
-        EVENT_TO_STRING(ADMIN);
-        EVENT_TO_STRING(SESSION_STATUS);
-        EVENT_TO_STRING(SUBSCRIPTION_STATUS);
-        EVENT_TO_STRING(REQUEST_STATUS);
-        EVENT_TO_STRING(RESPONSE);
-        EVENT_TO_STRING(PARTIAL_RESPONSE);
-        EVENT_TO_STRING(SUBSCRIPTION_DATA);
-        EVENT_TO_STRING(SERVICE_STATUS);
-        EVENT_TO_STRING(TIMEOUT);
-        EVENT_TO_STRING(AUTHORIZATION_STATUS);
-        EVENT_TO_STRING(RESOLUTION_STATUS);
-        EVENT_TO_STRING(TOPIC_STATUS);
-        EVENT_TO_STRING(TOKEN_STATUS);
-        EVENT_TO_STRING(REQUEST);
-        EVENT_TO_STRING(UNKNOWN);
+    // Wake the consumer and wait, with 'd_drain_mutex' held, until it
+    // signals 'cond'.  The wait is bounded because the consumer reads
+    // the count of waiters without locking, so it may miss a producer
+    // which has only just begun to wait.
+    static const long MAX_WAIT = 1000 * 1000;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct timespec ts;
+    ts.tv_sec = tv.tv_sec;
+    ts.tv_nsec = tv.tv_usec * 1000 + MAX_WAIT;
+    if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000 * 1000 * 1000;
     }
+
+    uv_async_send(d_async);
+    pthread_cond_timedwait(cond, &d_drain_mutex, &ts);
 }
 
 void
-Session::processMessage(blpapi::Event::EventType et, const blpapi::Message& msg)
+Session::broadcast(pthread_cond_t* cond)
 {
-    Handle<Value> argv[2];
+    pthread_mutex_lock(&d_drain_mutex);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&d_drain_mutex);
+}
 
-    const blpapi::Name& messageType = msg.messageType();
-    argv[0] = String::New(messageType.string(), messageType.length());
+void
+Session::updatePeakDepth()
+{
+    size_t depth = d_que.depth();
+    size_t peak = d_peak_depth;
+    while (depth > peak &&
+           !__sync_bool_compare_and_swap(&d_peak_depth, peak, depth))
+        peak = d_peak_depth;
+}
 
-    Local<Object> o = Object::New();
+void*
+Session::replayEvents(void* arg)
+{
+    reinterpret_cast<Session*>(arg)->replay();
+    return 0;
+}
 
-    o->Set(s_event_type, eventTypeToString(et),
-           (PropertyAttribute)(ReadOnly | DontDelete));
-    o->Set(s_message_type, argv[0],
-           (PropertyAttribute)(ReadOnly | DontDelete));
-    o->Set(s_topic_name, String::New(msg.topicName()),
-           (PropertyAttribute)(ReadOnly | DontDelete));
+void
+Session::replay()
+{
+    // Each event is held back until the recorded gap since the first one
+    // has elapsed, scaled by the replay speed; a speed of zero replays
+    // as fast as the consumer allows.
+    blpapi::Name terminated("SessionTerminated");
+    uint64_t start = uv_hrtime();
+    double first = 0;
+    bool timed = false;
+    std::vector<char> data;
+
+    while (!d_offline_stop) {
+        uint32_t length;
+        double time;
+        int32_t eventType;
+        if (1 != fread(&length, sizeof(length), 1, d_replay) ||
+            length < sizeof(time) + sizeof(eventType) ||
+            1 != fread(&time, sizeof(time), 1, d_replay) ||
+            1 != fread(&eventType, sizeof(eventType), 1, d_replay))
+            break;
+        data.resize(length - sizeof(time) - sizeof(eventType) + 1);
+        if (data.size() > 1 &&
+            1 != fread(&data[0], data.size() - 1, 1, d_replay))
+            break;
 
-    Local<Array> correlations = Array::New(msg.numCorrelationIds());
-    for (int i = 0, j = 0; i < msg.numCorrelationIds(); ++i) {
-        blpapi::CorrelationId cid = msg.correlationId(i);
-        // Only pack user-specified integers and auto-generated
-        // values into the correlations array returned to the user.
-        if (cid.valueType() == blpapi::CorrelationId::INT_VALUE ||
-            cid.valueType() == blpapi::CorrelationId::AUTOGEN_VALUE) {
-            Local<Object> cido = Object::New();
-            cido->Set(s_value, Integer::New(cid.asInteger()));
-            cido->Set(s_class_id, Integer::New(cid.classId()));
-            correlations->Set(j++, cido);
-        } else {
-            correlations->Set(j++, Object::New());
+        blpapi_Name_t *messageType;
+        EventBuffer *buffer = EventBuffer::fromPortable(&data[0],
+                                                        data.size() - 1,
+                                                        &messageType);
+        if (!buffer)
+            break;
+
+        // The recorded session terminates when this one is stopped.
+        if (eventType == blpapi::Event::SESSION_STATUS &&
+            messageType == terminated.impl()) {
+            delete buffer;
+            continue;
         }
-    }
-    o->Set(s_correlations, correlations,
-           (PropertyAttribute)(ReadOnly | DontDelete));
 
-    o->Set(s_data, elementToValue(msg.asElement()));
+        if (d_replay_speed > 0) {
+            if (!timed) {
+                first = time;
+                timed = true;
+            }
+            waitUntil(start + static_cast<uint64_t>(
+                    (time - first) * 1e6 / d_replay_speed));
+        }
 
-    argv[1] = o;
+        pushReplayed(eventType, buffer);
+    }
 
-    this->emit(ARRAY_SIZE(argv), argv);
+    finishOffline();
 }
 
-void
-Session::processEvents(uv_async_t *async, int status)
+void*
+Session::synthesizeEvents(void* arg)
 {
-    HandleScope scope;
+    reinterpret_cast<Session*>(arg)->synthesize();
+    return 0;
+}
 
-    Session *session = reinterpret_cast<Session *>(async->data);
+void
+Session::synthesize()
+{
+    // Announce the session and every topic, then tick the topics in turn.
+    // Each topic's price follows a random walk from a fixed seed, so that
+    // runs are reproducible, and its fields are offsets from that price.
+    static const char *fieldNames[] = {
+        "LAST_PRICE", "BID", "ASK", "BID_SIZE", "ASK_SIZE", "VOLUME"
+    };
+    const SyntheticFeed& feed = d_synthetic;
+
+    std::vector<blpapi::Name> fields;
+    for (int i = 0; i < feed.fields; ++i) {
+        char name[32];
+        if (i < static_cast<int>(ARRAY_SIZE(fieldNames)))
+            snprintf(name, sizeof(name), "%s", fieldNames[i]);
+        else
+            snprintf(name, sizeof(name), "FIELD%d", i);
+        fields.push_back(blpapi::Name(name));
+    }
 
-    bool empty;
-    do {
-        // Determine if the queue is empty
-        pthread_mutex_lock(&session->d_que_mutex);
-        empty = session->d_que.empty();
-        if (empty) {
-            pthread_mutex_unlock(&session->d_que_mutex);
-            break;
+    std::vector<std::string> topics(feed.topics);
+    std::vector<double> prices(feed.topics, 100);
+    blpapi::Name started("SubscriptionStarted");
+    EventBuffer *status = new EventBuffer;
+    for (int i = 0; i < feed.topics; ++i) {
+        char topic[32];
+        snprintf(topic, sizeof(topic), "SYNTH%d Equity", i);
+        topics[i] = topic;
+        status->addMessage(started, topic, i, 0);
+    }
+    pushReplayed(blpapi::Event::SESSION_STATUS,
+                 new EventBuffer(blpapi::Name("SessionStarted")));
+    pushReplayed(blpapi::Event::SUBSCRIPTION_STATUS, status);
+
+    blpapi::Name marketData("MarketDataEvents");
+    uint64_t start = uv_hrtime();
+    uint32_t seed = 1;
+    int topic = 0;
+    for (double n = 0; !d_offline_stop && (0 == feed.count || n < feed.count);
+         ++n) {
+        if (feed.rate > 0)
+            waitUntil(start + static_cast<uint64_t>(n * 1e9 / feed.rate));
+
+        EventBuffer *buffer = new EventBuffer;
+        for (int i = 0; i < feed.messagesPerEvent; ++i) {
+            seed = seed * 1103515245 + 12345;
+            double& price = prices[topic];
+            price += (static_cast<int>((seed >> 16) % 201) - 100) / 1000.0;
+            buffer->addMessage(marketData, topics[topic].c_str(), topic,
+                               fields.size());
+            for (size_t j = 0; j < fields.size(); ++j)
+                buffer->addNumber(fields[j], price + j * 0.01);
+            topic = (topic + 1) % feed.topics;
         }
+        pushReplayed(blpapi::Event::SUBSCRIPTION_DATA, buffer);
+    }
 
-        // Keep the lock and release once the head is retrieved
-        const blpapi::Event& ev = session->d_que.front();
-        pthread_mutex_unlock(&session->d_que_mutex);
+    finishOffline();
+}
 
-        // Iterate over contained messages without holding lock
-        blpapi::MessageIterator msgIter(ev);
-        while (msgIter.next()) {
-            const blpapi::Message& msg = msgIter.message();
-            session->processMessage(ev.eventType(), msg);
-        }
+void
+Session::waitUntil(uint64_t due)
+{
+    // Sleep in slices so that stopping is noticed promptly.
+    static const uint64_t MAX_SLEEP = 10 * 1000 * 1000;
+    for (uint64_t now = uv_hrtime(); now < due && !d_offline_stop;
+         now = uv_hrtime()) {
+        uint64_t ns = std::min(due - now, MAX_SLEEP);
+        struct timespec ts = { 0, static_cast<long>(ns) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+void
+Session::finishOffline()
+{
+    // Report the end of the events unless stopped first, then terminate
+    // the session once stopped, as a connected session would.
+    if (!d_offline_stop)
+        pushReplayed(blpapi::Event::SESSION_STATUS,
+                     new EventBuffer(blpapi::Name("ReplayCompleted")));
+    while (!d_offline_stop)
+        waitUntil(uv_hrtime() + 1000 * 1000 * 1000);
+    if (1 == d_offline_stop)
+        pushReplayed(blpapi::Event::SESSION_STATUS,
+                     new EventBuffer(blpapi::Name("SessionTerminated")));
+}
+
+void
+Session::pushReplayed(int eventType, EventBuffer* buffer)
+{
+    QueuedEvent qe;
+    qe.eventType = eventType;
+    qe.buffer = buffer;
+    if (d_latency)
+        qe.received = uv_hrtime();
+
+    // Replayed events are admitted, filtered and encoded as received
+    // ones are.
+    admit(eventType);
+    if (!filterReplayed(&qe)) {
+        qe.release();
+        return;
+    }
+    encodeWire(&qe);
+
+    // The queue is not drained once the session is being destroyed.
+    if (!enqueue(qe))
+        qe.release();
+}
 
-        // Reacquire and pop, updating empty flag to having to
-        // loop and acquire the mutex for a second time.
-        pthread_mutex_lock(&session->d_que_mutex);
-        session->d_que.pop_front();
-        empty = session->d_que.empty();
-        pthread_mutex_unlock(&session->d_que_mutex);
-    } while (!empty);
+// Load into 'value' the number encoded at 'data', with dates and times
+// in milliseconds since the epoch.  Return false if it is not a number.
+static inline bool
+mknumber(double* value, const char* data)
+{
+    EventBuffer::Reader reader(data);
+    switch (reader.read<uint8_t>()) {
+        case EventBuffer::TAG_INT32:
+            *value = reader.read<int32_t>();
+            return true;
+        case EventBuffer::TAG_NUMBER:
+        case EventBuffer::TAG_DATE:
+            *value = reader.read<double>();
+            return true;
+        default:
+            return false;
+    }
 }
 
 bool
-Session::processEvent(const blpapi::Event& ev, blpapi::Session* session)
+Session::filterReplayed(QueuedEvent* qe)
 {
-    pthread_mutex_lock(&d_que_mutex);
+    // Mirrors 'processEvent', over the messages encoded in the buffer.
+    bool data = qe->eventType == blpapi::Event::SUBSCRIPTION_DATA;
+    bool conflateAll = data && d_overloaded &&
+                       d_overflow == OVERFLOW_CONFLATE;
+    if (data)
+        pthread_rwlock_rdlock(&d_subscriptions_lock);
+    bool settings = data && (!d_subscriptions.empty() || conflateAll);
+    if (!settings && !d_conflator.pending()) {
+        if (data)
+            pthread_rwlock_unlock(&d_subscriptions_lock);
+        return true;
+    }
+
+    EventBuffer *filtered = new EventBuffer;
+    std::vector<EncodedField> fields;
+    std::vector<EncodedField> projected;
+    std::vector<ConflatedUpdate::Field> merged;
+    std::vector<std::pair<blpapi_Name_t*, double> > values;
+    uint32_t numKept = 0;
+    uint32_t numConflated = 0;
+    bool wake = false;
+
+    EventBuffer::Reader reader(*qe->buffer);
+    uint32_t numMessages = reader.read<uint32_t>();
+    for (uint32_t i = 0; i < numMessages; ++i) {
+        const char *begin = reader.position();
+        blpapi_Name_t *messageType = reader.read<blpapi_Name_t*>();
+        uint32_t length;
+        const char *topic = reader.readString(&length);
+        uint32_t numCorrelationIds = reader.read<uint32_t>();
+        bool hasCorrelation = false;
+        int correlation = 0;
+        int classId = 0;
+        for (uint32_t j = 0; j < numCorrelationIds; ++j) {
+            uint8_t valueType = reader.read<uint8_t>();
+            int64_t value = reader.read<int64_t>();
+            int32_t cls = reader.read<int32_t>();
+            if (0 == j && valueType == blpapi::CorrelationId::INT_VALUE) {
+                hasCorrelation = true;
+                correlation = static_cast<int>(value);
+                classId = cls;
+            }
+        }
+        const char *header = reader.position();
+
+        const Subscription *subscription = 0;
+        if (data && hasCorrelation) {
+            SubscriptionMap::const_iterator it =
+                d_subscriptions.find(correlation);
+            if (it != d_subscriptions.end())
+                subscription = &it->second;
+            else if (conflateAll)
+                subscription = &OVERFLOW_CONFLATION;
+        }
+
+        // Messages without settings are kept as they are.
+        if (!subscription ||
+            EventBuffer::TAG_OBJECT != static_cast<uint8_t>(*header)) {
+            if (hasCorrelation && d_conflator.pending())
+                takeConflated(qe, correlation);
+            reader.skipValue();
+            filtered->copyMessage(begin, reader.position() - begin);
+            ++numKept;
+            continue;
+        }
+
+        reader.read<uint8_t>();
+        uint32_t numFields = reader.read<uint32_t>();
+        fields.resize(numFields);
+        for (uint32_t j = 0; j < numFields; ++j) {
+            fields[j].name = reader.read<blpapi_Name_t*>();
+            fields[j].value = reader.position();
+            reader.skipValue();
+            fields[j].length = reader.position() - fields[j].value;
+        }
+
+        const Subscription::Bars& bars = subscription->bars;
+        if (bars.kind != Subscription::Bars::NONE) {
+            double price = 0;
+            double size = 0;
+            bool hasPrice = false;
+            for (uint32_t j = 0; j < numFields; ++j) {
+                if (fields[j].name == bars.price.impl())
+                    hasPrice = mknumber(&price, fields[j].value);
+                else if (fields[j].name == bars.volume.impl() &&
+                         !mknumber(&size, fields[j].value))
+                    size = 0;
+            }
+            if (hasPrice) {
+                if (d_bars.add(correlation, classId, topic, bars, price,
+                               size, mknowms()))
+                    wake = true;
+                continue;
+            }
+        }
+
+        if (subscription->projection.empty()) {
+            projected.swap(fields);
+        } else {
+            projected.clear();
+            for (size_t k = 0; k < subscription->projection.size(); ++k) {
+                blpapi_Name_t *name = subscription->projection[k].impl();
+                for (uint32_t j = 0; j < numFields; ++j) {
+                    if (fields[j].name == name) {
+                        projected.push_back(fields[j]);
+                        break;
+                    }
+                }
+            }
+        }
 
-    d_que.push_back(ev);
+        if (subscription->cache != Subscription::CACHE_NONE) {
+            values.clear();
+            for (size_t j = 0; j < projected.size(); ++j) {
+                double value;
+                if (mknumber(&value, projected[j].value))
+                    values.push_back(std::make_pair(projected[j].name,
+                                                    value));
+            }
+            d_cache.update(correlation, values);
+            if (subscription->cache == Subscription::CACHE_ONLY)
+                continue;
+        }
 
-    pthread_mutex_unlock(&d_que_mutex);
+        if (subscription->conflate >= 0 || conflateAll) {
+            merged.resize(projected.size());
+            for (size_t j = 0; j < projected.size(); ++j) {
+                merged[j].name = projected[j].name;
+                merged[j].encoded.assign(projected[j].value,
+                                         projected[j].length);
+            }
+            d_conflator.merge(correlation, classId, messageType, topic,
+                              merged, d_que.claimed());
+            ++numConflated;
+            continue;
+        }
+        if (d_conflator.pending())
+            takeConflated(qe, correlation);
+
+        filtered->copyMessageHeader(begin, header - begin, projected.size());
+        for (size_t j = 0; j < projected.size(); ++j)
+            filtered->copyField(projected[j].name, projected[j].value,
+                                projected[j].length);
+        ++numKept;
+    }
 
-    s_async.data = this;
-    uv_async_send(&s_async);
+    if (data)
+        pthread_rwlock_unlock(&d_subscriptions_lock);
 
+    if (numConflated > 0 || wake)
+        uv_async_send(d_async);
+    if (numMessages > 0 && 0 == numKept) {
+        delete filtered;
+        return false;
+    }
+    delete qe->buffer;
+    qe->buffer = filtered;
     return true;
 }
 
@@ -0,0 +1,84 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+// Conversion of BLPAPI datetimes to milliseconds since the epoch, UTC, by
+// arithmetic alone.  Kept apart from blpapijs.cpp so that it can be tested
+// without Node.js; see test/Datetime.cpp.
+
+#ifndef BLPAPIJS_DATETIME_H
+#define BLPAPIJS_DATETIME_H
+
+#include <blpapi_datetime.h>
+#include <blpapi_types.h>
+
+#include <ctime>
+
+namespace BloombergLP {
+namespace blpapijs {
+
+static const double MS_PER_DAY = 86400000.0;
+
+// Return the number of days from 1970-01-01 to the specified date in the
+// proleptic Gregorian calendar.  Years are shifted to start in March so
+// the leap day falls at the end, and counted in 400 year eras.
+static inline int
+mkdays(int year, unsigned month, unsigned day)
+{
+    year -= month <= 2;
+    const int era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(year - era * 400);
+    const unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5
+                       + day - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int>(doe) - 719468;
+}
+
+// Return the milliseconds since the epoch of the current UTC midnight.
+static inline double
+mktoday()
+{
+    time_t sec = time(NULL);
+    return static_cast<double>(sec / 86400) * MS_PER_DAY;
+}
+
+// Load into 'ms' the milliseconds since the epoch represented by 'dt',
+// decoded from an element of the specified 'datatype'.  Missing dates
+// default to today and missing times to midnight, UTC.  TIME values are
+// always taken to be today, even when 'dt' also carries a date, and DATE
+// values ignore any time.  Return false if 'dt' lacks the parts required
+// by 'datatype'.  Safe to call from any thread.
+static inline bool
+mkepochms(double* ms, const blpapi::Datetime& dt, int datatype)
+{
+    bool hasDate = dt.hasParts(blpapi::DatetimeParts::DATE);
+    bool hasTime = dt.hasParts(blpapi::DatetimeParts::TIME);
+
+    switch (datatype) {
+        case blpapi::DataType::DATE:
+            if (!hasDate)
+                return false;
+            *ms = mkdays(dt.year(), dt.month(), dt.day()) * MS_PER_DAY;
+            return true;
+        case blpapi::DataType::TIME:
+            if (!hasTime)
+                return false;
+            hasDate = false;
+            break;
+        default:
+            break;
+    }
+
+    *ms = hasDate ? mkdays(dt.year(), dt.month(), dt.day()) * MS_PER_DAY
+                  : mktoday();
+    if (hasTime) {
+        *ms += (dt.hours() * 3600 + dt.minutes() * 60 + dt.seconds())
+             * 1000.0;
+    }
+    if (dt.hasParts(blpapi::DatetimeParts::TIMEMILLI))
+        *ms += dt.milliSeconds();
+    return true;
+}
+
+}   // close namespace blpapijs
+}   // close namespace BloombergLP
+
+#endif
@@ -0,0 +1,109 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+var blpapi = require('node-blpapi');
+
+// Benchmark the addon's hot paths against a synthetic feed, which needs
+// no connection.  For each configuration, report the message rate of
+// the queue and decode, the heap growth per message, the strings
+// interned natively, which should not grow with the number of messages,
+// and the worst lag of a 10ms timer, then the rate of building
+// subscriptions.  Usage:
+//
+//   node Benchmark.js [events] [topics] [fields] [messagesPerEvent]
+//
+// The scope is narrower than the hot paths of a live session.  The
+// synthetic feed hands the queue pre-encoded events, so decoding is
+// measured from those buffers, not from BLPAPI elements through
+// 'elementToValue'.  Request marshalling is not covered, since it needs
+// the schema of an opened service.  Both need a connection to measure.
+
+var events = parseInt(process.argv[2] || '200000');
+var feed = { topics: parseInt(process.argv[3] || '1000'),
+             fields: parseInt(process.argv[4] || '6'),
+             messagesPerEvent: parseInt(process.argv[5] || '1'),
+             count: events };
+
+var configurations = [
+    { name: 'default', options: {} },
+    { name: 'batch', options: { batch: true, maxBatch: 256 } },
+    { name: 'drain budget', options: { maxDrainMessages: 1000 } },
+    { name: 'latency', options: { latency: true } },
+    { name: 'wire', options: { wire: true } }
+];
+
+function decode(configuration, done) {
+    var options = { synthetic: feed };
+    for (var k in configuration.options)
+        options[k] = configuration.options[k];
+    var session = new blpapi.Session(options);
+
+    var received = 0;
+    var heap = process.memoryUsage().heapUsed;
+    var started = Date.now();
+
+    // Sample the lag of a 10ms timer while the feed is drained
+    var interval = 10;
+    var expected = Date.now() + interval;
+    var worst = 0;
+    var timer = setInterval(function() {
+        worst = Math.max(worst, Date.now() - expected);
+        expected = Date.now() + interval;
+    }, interval);
+
+    session.on('MarketDataEvents', function(m) {
+        received += Array.isArray(m) ? m.length : 1;
+    });
+
+    session.on('WireData', function(chunk) {
+        received += blpapi.decodeWire(chunk).length;
+    });
+
+    session.on('ReplayCompleted', function(m) {
+        var elapsed = (Date.now() - started) / 1000;
+        var grown = process.memoryUsage().heapUsed - heap;
+        console.log(configuration.name,
+                    '\tmessages/s', Math.round(received / elapsed),
+                    '\theap bytes/message', Math.round(grown / received),
+                    '\tinterned', session.stats().strings.interned,
+                    '\tmax lag ms', Math.max(0, worst));
+        clearInterval(timer);
+        session.stop();
+    });
+
+    session.on('SessionTerminated', function(m) {
+        session.destroy();
+        done();
+    });
+
+    session.start();
+}
+
+function subscribe() {
+    // Offline sessions build and register subscriptions without sending
+    var session = new blpapi.Session({ synthetic: { topics: 1, count: 1 } });
+    session.on('SessionTerminated', function(m) {
+        session.destroy();
+    });
+    session.start();
+
+    var fields = ['LAST_PRICE', 'BID', 'ASK', 'VOLUME'];
+    var count = 100000;
+    var list = new Array(count);
+    for (var i = 0; i < count; ++i) {
+        list[i] = { security: 'SYNTH' + i + ' Equity', correlation: i,
+                    fields: fields };
+    }
+    var started = Date.now();
+    session.subscribe(list);
+    var elapsed = (Date.now() - started) / 1000;
+    console.log('subscribe', '\tsubscriptions/s',
+                Math.round(count / elapsed));
+    session.stop();
+}
+
+(function next(i) {
+    if (i < configurations.length)
+        decode(configurations[i], function() { next(i + 1); });
+    else
+        subscribe();
+})(0);
@@ -0,0 +1,84 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+var c = require('./Console.js');
+var blpapi = require('node-blpapi');
+
+// Measure how late a 10ms timer fires while subscription data floods
+// the session, to compare drain budgets.  In place of a host, 'synthetic'
+// floods the session from a synthetic feed of the same securities and
+// fields, optionally paced at 'rate' events per second, so that budgets
+// can be compared with no connection.  Usage:
+//
+//   node EventLoopLag.js <host>[:<port>] [maxDrainMessages] [maxDrainTime]
+//   node EventLoopLag.js synthetic [maxDrainMessages] [maxDrainTime] [rate]
+
+var synthetic = 'synthetic' == process.argv[2];
+var maxDrainMessages = parseInt(process.argv[3] || '0');
+var maxDrainTime = parseFloat(process.argv[4] || '0');
+var options = { maxDrainMessages: maxDrainMessages,
+                maxDrainTime: maxDrainTime };
+var service_mktdata = 1; // Unique identifier for mktdata service
+
+var seclist = ['AAPL US Equity', 'MSFT US Equity', 'GOOG US Equity',
+               'IBM US Equity', 'VOD LN Equity', 'BP/ LN Equity',
+               'EUR Curncy', 'JPY Curncy', 'GBP Curncy', 'ESA Index',
+               'NQA Index', 'TYA Comdty', 'CLA Comdty', 'GCA Comdty'];
+var fields = ['LAST_PRICE', 'BID', 'ASK', 'BID_SIZE', 'ASK_SIZE', 'VOLUME'];
+
+if (synthetic) {
+    // The synthetic feed ticks every topic without being subscribed
+    options.synthetic = { topics: seclist.length, fields: fields.length,
+                          rate: parseFloat(process.argv[5] || '0') };
+} else {
+    var hp = c.getHostPort();
+    options.host = hp.host;
+    options.port = hp.port;
+}
+var session = new blpapi.Session(options);
+
+var received = 0;
+
+session.on('SessionStarted', function(m) {
+    if (!synthetic)
+        session.openService('//blp/mktdata', service_mktdata);
+});
+
+session.on('ServiceOpened', function(m) {
+    if (m.correlations[0].value == service_mktdata) {
+        // Subscribe to every tick of each security, with no interval
+        session.subscribe(seclist.map(function(s, i) {
+            return { security: s, correlation: 100 + i, fields: fields };
+        }));
+    }
+});
+
+session.on('MarketDataEvents', function(m) {
+    ++received;
+});
+
+// Sample the lag of a 10ms timer, reporting once a second
+var interval = 10;
+var expected = Date.now() + interval;
+var samples = 0, total = 0, worst = 0;
+
+setInterval(function() {
+    var lag = Math.max(0, Date.now() - expected);
+    expected = Date.now() + interval;
+    ++samples;
+    total += lag;
+    worst = Math.max(worst, lag);
+}, interval);
+
+setInterval(function() {
+    var q = session.stats().queue;
+    console.log('messages/s', received,
+                'lag avg', samples ? (total / samples).toFixed(2) : 0,
+                'max', worst,
+                'depth', q.depth, 'peak', q.peakDepth, 'yields', q.yields);
+    received = samples = total = worst = 0;
+}, 1000);
+
+// Helper to put the console in raw mode and shutdown session on close
+c.createConsole(session);
+
+session.start();
@@ -0,0 +1,89 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+var c = require('./Console.js');
+var blpapi = require('node-blpapi');
+
+// Compare eager and lazy decoding of wide market data messages.  Two
+// sessions subscribe to the same securities and fields, one decoding
+// 'data' eagerly and one lazily, and their handlers read three fields
+// as typical handlers do.  After the given number of seconds, report the
+// time each spent per message between dequeuing and the return of its
+// handlers, which includes the decode, and the lazy objects alive.
+// Usage:
+//
+//   node LazyBenchmark.js <host>[:<port>] [seconds]
+
+var hp = c.getHostPort();
+var seconds = parseInt(process.argv[3] || '60');
+var service_mktdata = 1; // Unique identifier for mktdata service
+
+var securities = [
+    'AAPL US Equity', 'MSFT US Equity', 'IBM US Equity', 'GOOG US Equity',
+    'INTC US Equity', 'CSCO US Equity', 'ORCL US Equity', 'QCOM US Equity',
+    'XOM US Equity', 'GE US Equity', 'JPM US Equity', 'BAC US Equity',
+    'C US Equity', 'WFC US Equity', 'PFE US Equity', 'T US Equity',
+    'VZ US Equity', 'KO US Equity', 'PG US Equity', 'JNJ US Equity'
+];
+
+// Subscribing to every field group makes the messages wide.
+var fields = [
+    'LAST_PRICE', 'BID', 'ASK', 'BID_SIZE', 'ASK_SIZE', 'VOLUME', 'HIGH',
+    'LOW', 'OPEN', 'RT_PX_CHG_PCT_1D', 'RT_PX_CHG_NET_1D', 'VWAP',
+    'LAST_TRADE', 'SIZE_LAST_TRADE', 'TIME', 'BID_UPDATE_STAMP_RT',
+    'ASK_UPDATE_STAMP_RT', 'TRADE_UPDATE_STAMP_RT', 'NUM_TRADES_RT',
+    'TURNOVER_TODAY_REALTIME'
+];
+
+var running = 0;
+
+function run(name, options) {
+    options.host = hp.host;
+    options.port = hp.port;
+    options.latency = true;
+    var session = new blpapi.Session(options);
+    var sum = 0;
+    ++running;
+
+    session.on('SessionStarted', function(m) {
+        session.openService('//blp/mktdata', service_mktdata);
+    });
+
+    session.on('ServiceOpened', function(m) {
+        session.subscribe(securities.map(function(s, i) {
+            return { security: s, correlation: i, fields: fields };
+        }));
+        setTimeout(function() { report(); }, seconds * 1000);
+    });
+
+    session.on('MarketDataEvents', function(m) {
+        var d = m.data;
+        sum += (d.LAST_PRICE || 0) + (d.BID || 0) + (d.ASK || 0);
+    });
+
+    function report() {
+        var stats = session.stats();
+        var md = stats.latency.messageTypes.MarketDataEvents;
+        if (md) {
+            console.log(name, '\tmessages', md.dispatch.count,
+                        '\tmean us', Math.round(md.dispatch.mean / 100) / 10,
+                        '\tp50 us', Math.round(md.dispatch.p50 / 100) / 10,
+                        '\tp99 us', Math.round(md.dispatch.p99 / 100) / 10,
+                        '\tpinned', stats.lazy.pinned,
+                        '\teager', stats.lazy.eager);
+        } else {
+            console.log(name, '\tno market data received');
+        }
+        session.stop();
+    }
+
+    session.on('SessionTerminated', function(m) {
+        session.destroy();
+        if (0 == --running)
+            process.exit();
+    });
+
+    session.start();
+}
+
+run('eager', {});
+run('lazy', { lazy: true });
@@ -0,0 +1,40 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+var blpapi = require('node-blpapi');
+
+// Replay a recording made with the 'record' session option and report
+// the message rate, which needs no connection.  Usage:
+//
+//   node Replay.js <recording> [replaySpeed]
+//
+// A replay speed of 0, the default, replays as fast as possible.
+
+if (process.argv.length < 3) {
+    console.log('Usage:', process.argv[0], process.argv[1],
+                '<recording> [replaySpeed]');
+    process.exit(-1);
+}
+
+var session = new blpapi.Session({
+    replay: process.argv[2],
+    replaySpeed: parseFloat(process.argv[3] || '0') });
+
+var received = 0;
+var started = Date.now();
+
+session.on('MarketDataEvents', function(m) {
+    ++received;
+});
+
+session.on('ReplayCompleted', function(m) {
+    var elapsed = (Date.now() - started) / 1000;
+    console.log('replayed', received, 'messages in', elapsed, 's,',
+                Math.round(received / elapsed), 'messages/s');
+    session.stop();
+});
+
+session.on('SessionTerminated', function(m) {
+    session.destroy();
+});
+
+session.start();
@@ -0,0 +1,62 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+var c = require('./Console.js');
+var blpapi = require('node-blpapi');
+
+// Time the main thread cost of subscribing to a large universe, one
+// object per security with 'subscribe' and in bulk with 'subscribeBulk'.
+// Usage:
+//
+//   node SubscribeBenchmark.js <host>[:<port>] [count]
+//
+// The synthetic securities need not exist; failures to resolve them
+// arrive later as 'SubscriptionFailure' messages and are ignored.
+
+var hp = c.getHostPort();
+var counts = process.argv[3] ? [parseInt(process.argv[3])] : [10000, 100000];
+var session = new blpapi.Session({ host: hp.host, port: hp.port });
+var service_mktdata = 1; // Unique identifier for mktdata service
+
+var fields = ['LAST_PRICE', 'BID', 'ASK', 'VOLUME'];
+
+function securities(count, prefix) {
+    var list = new Array(count);
+    for (var i = 0; i < count; ++i)
+        list[i] = prefix + i + ' US Equity';
+    return list;
+}
+
+session.on('SessionStarted', function(m) {
+    session.openService('//blp/mktdata', service_mktdata);
+});
+
+session.on('ServiceOpened', function(m) {
+    if (m.correlations[0].value != service_mktdata)
+        return;
+
+    var cid = 1000;
+    counts.forEach(function(count) {
+        var list = securities(count, 'A');
+        var start = Date.now();
+        session.subscribe(list.map(function(s) {
+            return { security: s, correlation: cid++, fields: fields };
+        }));
+        console.log('subscribe', count, Date.now() - start, 'ms');
+
+        list = securities(count, 'B');
+        var cids = new Int32Array(count);
+        for (var i = 0; i < count; ++i)
+            cids[i] = cid++;
+        start = Date.now();
+        session.subscribeBulk({ fields: fields }, list, cids);
+        console.log('subscribeBulk', count, Date.now() - start, 'ms');
+    });
+
+    session.stop();
+});
+
+session.on('SessionTerminated', function(m) {
+    session.destroy();
+});
+
+session.start();
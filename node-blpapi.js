@@ -37,7 +37,36 @@ exports.Session.prototype.resubscribe =
     function(sub, label) {
         return this.session.resubscribe(sub, label);
     }
+exports.Session.prototype.subscribeBulk =
+    function(shared, securities, cids, label) {
+        return this.session.subscribeBulk(shared, securities, cids, label);
+    }
+exports.Session.prototype.unsubscribe =
+    function(cids) {
+        return this.session.unsubscribe(cids);
+    }
+exports.Session.prototype.applyUniverse =
+    function(sub, label) {
+        return this.session.applyUniverse(sub, label);
+    }
+exports.Session.prototype.snapshot =
+    function(cids, fields) {
+        return this.session.snapshot(cids, fields);
+    }
 exports.Session.prototype.request =
-    function(uri, name, request, cid, label) {
-        return this.session.request(uri, name, request, cid, label);
+    function(uri, name, request, cid, label, options) {
+        return this.session.request(uri, name, request, cid, label, options);
+    }
+exports.Session.prototype.prepareRequest =
+    function(uri, name, shape) {
+        return this.session.prepareRequest(uri, name, shape);
+    }
+exports.Session.prototype.stats =
+    function(reset) {
+        return this.session.stats(reset);
+    }
+
+exports.decodeWire =
+    function(chunk) {
+        return blpapi.decodeWire(chunk);
     }
@@ -0,0 +1,49 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+// Batched delivery emits arrays of at most 'maxBatch' messages which,
+// concatenated, hold every message of the feed in order.
+
+var assert = require('assert');
+var blpapi = require('../node-blpapi');
+
+var topics = 10;
+var events = 2000;
+var messagesPerEvent = 7;
+var maxBatch = 16;
+
+var session = new blpapi.Session({
+    synthetic: { topics: topics, fields: 3,
+                 messagesPerEvent: messagesPerEvent, count: events },
+    batch: true,
+    maxBatch: maxBatch
+});
+
+var received = 0;
+var batches = 0;
+
+session.on('MarketDataEvents', function(messages) {
+    assert.ok(Array.isArray(messages));
+    assert.ok(messages.length > 0 && messages.length <= maxBatch);
+    ++batches;
+    messages.forEach(function(m) {
+        // The feed ticks its topics in turn
+        var topic = received % topics;
+        assert.equal(m.eventType, 'SUBSCRIPTION_DATA');
+        assert.equal(m.topicName, 'SYNTH' + topic + ' Equity');
+        assert.equal(m.correlations[0].value, topic);
+        assert.equal(typeof m.data.LAST_PRICE, 'number');
+        ++received;
+    });
+});
+
+session.on('ReplayCompleted', function(m) {
+    session.stop();
+});
+
+session.on('SessionTerminated', function(m) {
+    session.destroy();
+    assert.equal(received, events * messagesPerEvent);
+    assert.ok(batches < received);
+});
+
+session.start();
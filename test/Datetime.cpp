@@ -0,0 +1,249 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+// Check the arithmetic datetime conversion of blpapijs_datetime.h against
+// the 'mktime' based conversion it replaced, across leap years, the epoch
+// and the 32-bit 'time_t' limit, then time both.  Built by
+//
+//   node-waf configure --tests build
+//
+// and run by 'npm test'.  Exits with the number of mismatches, at most 255.
+
+#include "../blpapijs_datetime.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <sys/time.h>
+
+using namespace BloombergLP;
+using namespace BloombergLP::blpapijs;
+
+namespace {
+
+// The conversion which 'mkepochms' replaced, kept as the reference.
+
+struct tm*
+mknow(struct tm* tm)
+{
+    time_t sec;
+    time(&sec);
+    return gmtime_r(&sec, tm);
+}
+
+time_t
+mkutctime(struct tm* tm)
+{
+    time_t ret;
+    char* tz = getenv("TZ");
+    setenv("TZ", "UTC", 1);
+    tzset();
+    ret = mktime(tm);
+    if (tz)
+        setenv("TZ", tz, 1);
+    else
+        unsetenv("TZ");
+    tzset();
+    return ret;
+}
+
+bool
+reference(double* ms, const blpapi::Datetime& dt, int datatype)
+{
+    struct tm date;
+    switch (datatype) {
+        case blpapi::DataType::DATE:
+            if (!dt.hasParts(blpapi::DatetimeParts::DATE))
+                return false;
+            date.tm_sec = 0;
+            date.tm_min = 0;
+            date.tm_hour = 0;
+            date.tm_mday = dt.day();
+            date.tm_mon = dt.month() - 1;
+            date.tm_year = dt.year() - 1900;
+            date.tm_isdst = 0;
+            *ms = mkutctime(&date) * 1000.0;
+            return true;
+        case blpapi::DataType::TIME:
+            if (!dt.hasParts(blpapi::DatetimeParts::TIME))
+                return false;
+            mknow(&date);
+            date.tm_sec = dt.seconds();
+            date.tm_min = dt.minutes();
+            date.tm_hour = dt.hours();
+            date.tm_isdst = 0;
+            break;
+        default:
+            if (dt.hasParts(blpapi::DatetimeParts::DATE)) {
+                date.tm_mday = dt.day();
+                date.tm_mon = dt.month() - 1;
+                date.tm_year = dt.year() - 1900;
+            } else {
+                mknow(&date);
+            }
+            if (dt.hasParts(blpapi::DatetimeParts::TIME)) {
+                date.tm_sec = dt.seconds();
+                date.tm_min = dt.minutes();
+                date.tm_hour = dt.hours();
+            } else {
+                date.tm_sec = 0;
+                date.tm_min = 0;
+                date.tm_hour = 0;
+            }
+            date.tm_isdst = 0;
+            break;
+    }
+    *ms = mkutctime(&date) * 1000.0;
+    if (dt.hasParts(blpapi::DatetimeParts::TIMEMILLI))
+        *ms += dt.milliSeconds();
+    return true;
+}
+
+const char *
+typeName(int datatype)
+{
+    switch (datatype) {
+        case blpapi::DataType::DATE: return "DATE";
+        case blpapi::DataType::TIME: return "TIME";
+        default: return "DATETIME";
+    }
+}
+
+int failures = 0;
+int cases = 0;
+
+void
+check(const blpapi::Datetime& dt, int datatype)
+{
+    // The day may turn between the two conversions of a time of today.
+    time_t day = time(NULL) / 86400;
+    double expected = 0, actual = 0;
+    bool expectedOk = reference(&expected, dt, datatype);
+    bool actualOk = mkepochms(&actual, dt, datatype);
+    if (time(NULL) / 86400 != day)
+        return;
+
+    ++cases;
+    if (expectedOk == actualOk && (!expectedOk || expected == actual))
+        return;
+    if (++failures <= 10) {
+        fprintf(stderr, "%s %04u-%02u-%02u %02u:%02u:%02u.%03u parts %u: "
+                "expected %.0f, got %.0f\n", typeName(datatype),
+                dt.year(), dt.month(), dt.day(), dt.hours(), dt.minutes(),
+                dt.seconds(), dt.milliSeconds(), dt.parts(),
+                expectedOk ? expected : -1, actualOk ? actual : -1);
+    }
+}
+
+void
+checkAll(const blpapi::Datetime& dt)
+{
+    check(dt, blpapi::DataType::DATE);
+    check(dt, blpapi::DataType::TIME);
+    check(dt, blpapi::DataType::DATETIME);
+}
+
+void
+checkDatetime(unsigned year, unsigned month, unsigned day,
+              unsigned hours, unsigned minutes, unsigned seconds,
+              unsigned milliSeconds)
+{
+    blpapi::Datetime date;
+    date.setDate(year, month, day);
+    checkAll(date);
+
+    blpapi::Datetime time;
+    time.setTime(hours, minutes, seconds);
+    checkAll(time);
+    time.setTime(hours, minutes, seconds, milliSeconds);
+    checkAll(time);
+
+    blpapi::Datetime datetime;
+    datetime.setDate(year, month, day);
+    datetime.setTime(hours, minutes, seconds);
+    checkAll(datetime);
+    datetime.setTime(hours, minutes, seconds, milliSeconds);
+    checkAll(datetime);
+}
+
+double
+elapsed(const struct timeval& start)
+{
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start.tv_sec) * 1e9
+         + (end.tv_usec - start.tv_usec) * 1e3;
+}
+
+}   // close anonymous namespace
+
+int
+main()
+{
+    static const unsigned DAYS_IN_MONTH[] = {
+        31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+    };
+
+    // Boundaries of the epoch, of a signed 32-bit 'time_t' and of leap
+    // days in century years.
+    checkDatetime(1969, 12, 31, 23, 59, 59, 999);
+    checkDatetime(1970, 1, 1, 0, 0, 0, 0);
+    checkDatetime(1970, 1, 1, 0, 0, 0, 1);
+    checkDatetime(2038, 1, 19, 3, 14, 7, 999);
+    checkDatetime(2038, 1, 19, 3, 14, 8, 0);
+    checkDatetime(1900, 2, 28, 12, 0, 0, 0);
+    checkDatetime(1900, 3, 1, 12, 0, 0, 0);
+    checkDatetime(2000, 2, 29, 23, 59, 59, 999);
+    checkDatetime(2100, 2, 28, 0, 0, 0, 0);
+    checkDatetime(2100, 3, 1, 0, 0, 0, 0);
+
+    // Every day from 1900 to 2099, at a pseudo-random time of day.
+    unsigned seed = 1;
+    for (unsigned year = 1900; year < 2100; ++year) {
+        bool leap = (0 == year % 4 && 0 != year % 100) || 0 == year % 400;
+        for (unsigned month = 1; month <= 12; ++month) {
+            unsigned days = DAYS_IN_MONTH[month - 1];
+            if (2 == month && !leap)
+                days = 28;
+            for (unsigned day = 1; day <= days; ++day) {
+                seed = seed * 1103515245 + 12345;
+                unsigned ms = (seed >> 8) % 86400000;
+                checkDatetime(year, month, day, ms / 3600000,
+                              ms / 60000 % 60, ms / 1000 % 60, ms % 1000);
+            }
+        }
+    }
+
+    printf("datetime: %d cases, %d failures\n", cases, failures);
+
+    // Time both conversions of intraday tick times.
+    static const int ITERATIONS = 200000;
+    blpapi::Datetime dt;
+    double before = 0, after = 0, ms;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < ITERATIONS; ++i) {
+        dt.setDate(2012, 1 + i % 12, 1 + i % 28);
+        dt.setTime(i % 24, i % 60, i % 60, i % 1000);
+        reference(&ms, dt, blpapi::DataType::DATETIME);
+        before += ms;
+    }
+    double referenceNs = elapsed(start) / ITERATIONS;
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < ITERATIONS; ++i) {
+        dt.setDate(2012, 1 + i % 12, 1 + i % 28);
+        dt.setTime(i % 24, i % 60, i % 60, i % 1000);
+        mkepochms(&ms, dt, blpapi::DataType::DATETIME);
+        after += ms;
+    }
+    double arithmeticNs = elapsed(start) / ITERATIONS;
+
+    printf("datetime: mktime %.1fns, arithmetic %.1fns per DATETIME\n",
+           referenceNs, arithmeticNs);
+    if (before != after)
+        ++failures;
+
+    return failures > 255 ? 255 : failures;
+}
@@ -0,0 +1,49 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+// Sessions paced at very different rates share the event loop, each
+// with its own async handle.  A busy session must not starve a quiet
+// one: every session receives all of its messages, and the time its
+// events wait in the queue stays bounded.
+
+var assert = require('assert');
+var blpapi = require('../node-blpapi');
+
+var seconds = 1;
+var rates = [5000, 500, 20];
+var bound = 50 * 1000 * 1000;  // ns
+
+var running = rates.length;
+
+rates.forEach(function(rate) {
+    var events = rate * seconds;
+    var session = new blpapi.Session({
+        synthetic: { topics: 10, fields: 2, rate: rate, count: events },
+        latency: true
+    });
+
+    var received = 0;
+    session.on('MarketDataEvents', function(m) {
+        ++received;
+    });
+
+    session.on('ReplayCompleted', function(m) {
+        var queue =
+            session.stats().latency.eventTypes.SUBSCRIPTION_DATA.queue;
+        assert.equal(received, events);
+        assert.equal(queue.count, events);
+        assert.ok(queue.p99 < bound,
+                  'rate ' + rate + ': p99 queue latency ' + queue.p99 + 'ns');
+        session.stop();
+    });
+
+    session.on('SessionTerminated', function(m) {
+        session.destroy();
+        --running;
+    });
+
+    session.start();
+});
+
+process.on('exit', function() {
+    assert.equal(running, 0);
+});
@@ -0,0 +1,104 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+// Stress the event queue with a synthetic feed, whose thread stands in
+// for the BLPAPI dispatcher as producer, and a consumer which stalls
+// from time to time.  With a tiny queue the producer keeps finding it
+// full and waiting; no event may be lost or reordered.  With the
+// 'dropOldest' policy events are shed instead, but a conflated topic
+// still ends on its last value.
+
+var assert = require('assert');
+var blpapi = require('../node-blpapi');
+
+// A low watermark needs a high one, and must be below it.
+assert.throws(function() {
+    new blpapi.Session({ synthetic: { topics: 1 }, lowWatermark: 8 });
+}, /requires 'highWatermark'/);
+assert.throws(function() {
+    new blpapi.Session({ synthetic: { topics: 1 }, highWatermark: 8,
+                         lowWatermark: 8 });
+}, /below 'highWatermark'/);
+
+var topics = 7;
+var events = 50000;
+var messagesPerEvent = 3;
+
+var session = new blpapi.Session({
+    synthetic: { topics: topics, fields: 2,
+                 messagesPerEvent: messagesPerEvent, count: events },
+    queueSize: 4
+});
+
+var received = 0;
+
+session.on('MarketDataEvents', function(m) {
+    assert.equal(m.correlations[0].value, received % topics);
+    ++received;
+
+    // Stall for a millisecond every few hundred messages
+    if (0 == received % 500)
+        stall();
+});
+
+session.on('ReplayCompleted', function(m) {
+    var queue = session.stats().queue;
+    assert.equal(queue.capacity, 4);
+    assert.equal(queue.enqueued, queue.dequeued);
+    assert.ok(queue.fullWaits > 0);
+    assert.ok(queue.peakDepth <= queue.capacity);
+    session.stop();
+});
+
+session.on('SessionTerminated', function(m) {
+    session.destroy();
+    assert.equal(received, events * messagesPerEvent);
+    dropOldest();
+});
+
+session.start();
+
+function stall() {
+    var until = Date.now() + 1;
+    while (Date.now() < until);
+}
+
+function dropOldest() {
+    var session = new blpapi.Session({
+        synthetic: { topics: topics, fields: 2,
+                     messagesPerEvent: messagesPerEvent, count: events },
+        queueSize: 64,
+        highWatermark: 16,
+        overflow: 'dropOldest'
+    });
+
+    // Topic 0 is conflated, and cached to know its last value.
+    session.subscribe([{ security: 'SYNTH0 Equity', correlation: 0,
+                         fields: ['LAST_PRICE'], conflate: 0,
+                         cache: true }]);
+
+    var received = 0;
+    var last;
+    var expected;
+
+    session.on('MarketDataEvents', function(m) {
+        if (0 == m.correlations[0].value)
+            last = m.data.LAST_PRICE;
+        if (0 == ++received % 100)
+            stall();
+    });
+
+    session.on('ReplayCompleted', function(m) {
+        expected = session.snapshot([0], ['LAST_PRICE']).LAST_PRICE[0];
+        session.stop();
+    });
+
+    session.on('SessionTerminated', function(m) {
+        var queue = session.stats().queue;
+        session.destroy();
+        assert.ok(queue.dropped > 0);
+        assert.ok(received < events * messagesPerEvent);
+        assert.equal(last, expected);
+    });
+
+    session.start();
+}
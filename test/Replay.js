@@ -0,0 +1,66 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+// Subscription settings apply to replayed and synthesized events as they
+// do to received ones: a projected topic delivers only its projection, a
+// topic cached only is never delivered, a conflated topic is delivered
+// at most once per tick, and the ticks of a bar topic become bars.
+
+var assert = require('assert');
+var blpapi = require('../node-blpapi');
+
+var topics = 5;
+var events = 2000;
+var ticksPerBar = 10;
+
+var session = new blpapi.Session({
+    synthetic: { topics: topics, fields: 6, messagesPerEvent: topics,
+                 count: events }
+});
+
+session.subscribe([
+    { security: 'SYNTH0 Equity', correlation: 0,
+      fields: ['BID'], project: true },
+    { security: 'SYNTH1 Equity', correlation: 1,
+      fields: ['LAST_PRICE'], project: true, cache: 'only' },
+    { security: 'SYNTH2 Equity', correlation: 2,
+      fields: ['LAST_PRICE'], conflate: 0 },
+    { security: 'SYNTH3 Equity', correlation: 3,
+      fields: ['LAST_PRICE'], bars: { ticks: ticksPerBar } }
+]);
+
+var received = [0, 0, 0, 0, 0];
+var bars = 0;
+
+session.on('MarketDataEvents', function(m) {
+    var cid = m.correlations[0].value;
+    ++received[cid];
+    if (0 == cid)
+        assert.deepEqual(Object.keys(m.data), ['BID']);
+    else
+        assert.equal(Object.keys(m.data).length, 6);
+});
+
+session.on('Bar', function(m) {
+    assert.equal(m.correlations[0].value, 3);
+    assert.equal(m.data.numTicks, ticksPerBar);
+    ++bars;
+});
+
+session.on('ReplayCompleted', function(m) {
+    var s = session.snapshot([1], ['LAST_PRICE', 'BID']);
+    assert.ok(isFinite(s.LAST_PRICE[0]));
+    assert.ok(isNaN(s.BID[0]));
+    session.stop();
+});
+
+session.on('SessionTerminated', function(m) {
+    session.destroy();
+    assert.equal(received[0], events);
+    assert.equal(received[1], 0);
+    assert.ok(received[2] > 0 && received[2] <= events);
+    assert.equal(received[3], 0);
+    assert.equal(received[4], events);
+    assert.equal(bars, events / ticksPerBar);
+});
+
+session.start();
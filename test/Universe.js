@@ -0,0 +1,64 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+// applyUniverse sends only the changes to the registered universe.  A
+// correlation id whose security changes is unsubscribed and subscribed
+// again, after which the registry holds the new topic, and the decoding
+// settings that came with it apply to the correlation id.
+
+var assert = require('assert');
+var blpapi = require('../node-blpapi');
+
+var topics = 3;
+var events = 300;
+
+var session = new blpapi.Session({
+    synthetic: { topics: topics, fields: 6, messagesPerEvent: topics,
+                 count: events }
+});
+
+function assertChanges(changes, subscribed, resubscribed, unsubscribed) {
+    assert.deepEqual(changes, { subscribed: subscribed,
+                                resubscribed: resubscribed,
+                                unsubscribed: unsubscribed });
+}
+
+assertChanges(session.applyUniverse([
+    { security: 'SYNTH1 Equity', correlation: 0, fields: ['LAST_PRICE'] },
+    { security: 'SYNTH2 Equity', correlation: 2, fields: ['LAST_PRICE'] }
+]), 2, 0, 0);
+
+// The security of correlation id 0 changes, that of 2 does not.
+var universe = [
+    { security: 'SYNTH0 Equity', correlation: 0,
+      fields: ['BID'], project: true },
+    { security: 'SYNTH2 Equity', correlation: 2, fields: ['LAST_PRICE'] }
+];
+assertChanges(session.applyUniverse(universe), 1, 0, 1);
+assertChanges(session.applyUniverse(universe), 0, 0, 0);
+
+// Dropping and restoring the changed subscription works from the
+// replacement, not the original.
+assertChanges(session.applyUniverse(universe.slice(1)), 0, 0, 1);
+assertChanges(session.applyUniverse(universe), 1, 0, 0);
+
+var received = [0, 0, 0];
+
+session.on('MarketDataEvents', function(m) {
+    var cid = m.correlations[0].value;
+    ++received[cid];
+    if (0 == cid)
+        assert.deepEqual(Object.keys(m.data), ['BID']);
+    else
+        assert.equal(Object.keys(m.data).length, 6);
+});
+
+session.on('ReplayCompleted', function(m) {
+    session.stop();
+});
+
+session.on('SessionTerminated', function(m) {
+    session.destroy();
+    assert.deepEqual(received, [events, events, events]);
+});
+
+session.start();
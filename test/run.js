@@ -0,0 +1,51 @@
+// Copyright (C) 2012 Bloomberg Finance L.P.
+
+// Run each test in this directory in its own process, in name order, and
+// exit with the number of tests that failed.  Tests drive offline sessions
+// and exit with a nonzero status on failure, so no connection is needed.
+// The native tests, built by 'node-waf configure --tests build', are run
+// first when present.  Usage:
+//
+//   node test/run.js [name...]
+
+var spawn = require('child_process').spawn;
+var fs = require('fs');
+var path = require('path');
+
+var build = path.join(__dirname, '..', 'build', 'Release');
+
+var names = process.argv.slice(2);
+if (0 == names.length) {
+    if (path.existsSync(build)) {
+        names = fs.readdirSync(build).filter(function(name) {
+            return /_test$/.test(name);
+        }).sort();
+    }
+    names = names.concat(fs.readdirSync(__dirname).filter(function(name) {
+        return /\.js$/.test(name) && 'run.js' != name;
+    }).sort());
+}
+
+var failed = 0;
+
+(function next(i) {
+    if (i == names.length) {
+        console.log(names.length - failed, 'passed,', failed, 'failed');
+        process.exit(failed);
+    }
+
+    var name = names[i];
+    var started = Date.now();
+    var child = /\.js$/.test(name)
+        ? spawn(process.execPath, [path.join(__dirname, name)])
+        : spawn(path.join(build, name), []);
+    child.stdout.pipe(process.stdout);
+    child.stderr.pipe(process.stderr);
+    child.on('exit', function(code) {
+        if (0 != code)
+            ++failed;
+        console.log(0 == code ? 'ok  ' : 'FAIL', name,
+                    (Date.now() - started) + 'ms');
+        next(i + 1);
+    });
+})(0);